@@ -5,15 +5,31 @@
 // SPDX-License-Identifier: MIT
 // ----------------------------------------------------------------------------
 
+#include "open3d/geometry/SurfaceReconstructionBallPivoting.h"
+
 #include <Eigen/Dense>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <list>
+#include <memory_resource>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "open3d/geometry/IntersectionTest.h"
 #include "open3d/geometry/KDTreeFlann.h"
 #include "open3d/geometry/PointCloud.h"
 #include "open3d/geometry/TriangleMesh.h"
+#include "open3d/utility/Helper.h"
 #include "open3d/utility/Logging.h"
+#include "open3d/utility/Parallel.h"
+#include "open3d/utility/Timer.h"
 
 namespace open3d {
 namespace geometry {
@@ -28,21 +44,33 @@ typedef std::shared_ptr<BallPivotingTriangle> BallPivotingTrianglePtr;
 
 class BallPivotingVertex {
 public:
-    enum Type { Orphan = 0, Front = 1, Inner = 2 };
+    enum Type : uint8_t { Orphan = 0, Front = 1, Inner = 2 };
 
     BallPivotingVertex(int idx,
                        const Eigen::Vector3d& point,
-                       const Eigen::Vector3d& normal)
-        : idx_(idx), point_(point), normal_(normal), type_(Orphan) {}
+                       const Eigen::Vector3d& normal,
+                       std::pmr::memory_resource* resource)
+        : idx_(idx),
+          type_(Orphan),
+          outlier_(false),
+          point_(point),
+          normal_(normal),
+          edges_(resource) {}
 
     void UpdateType();
+    void AddEdge(const BallPivotingEdgePtr& edge);
+    void RemoveEdge(const BallPivotingEdgePtr& edge);
 
 public:
+    //タイプと外れ値のフラグはidx_の後ろの隙間に詰める
     int idx_;
+    Type type_;
+    //近傍点の数が少なく，シードにも候補点にも使わない点(outlier_ratio_の場合)
+    bool outlier_;
     const Eigen::Vector3d& point_;
     const Eigen::Vector3d& normal_;
-    std::unordered_set<BallPivotingEdgePtr> edges_;
-    Type type_;
+    //頂点が属する辺．次数は小さい(閉じた面で平均6)ので，ハッシュセットではなく配列を線形に探す
+    std::pmr::vector<BallPivotingEdgePtr> edges_;
 };
 
 class BallPivotingEdge {
@@ -56,7 +84,7 @@ public:
     BallPivotingEdge(BallPivotingVertexPtr source, BallPivotingVertexPtr target)
         : source_(source), target_(target), type_(Type::Front) {}
 
-    void AddAdjacentTriangle(BallPivotingTrianglePtr triangle);
+    bool AddAdjacentTriangle(BallPivotingTrianglePtr triangle);
     BallPivotingVertexPtr GetOppositeVertex();
 
 public:
@@ -68,7 +96,7 @@ public:
     Type type_;
 };
 
-class BallPivotingfTriangle {
+class BallPivotingTriangle {
 public:
     BallPivotingTriangle(BallPivotingVertexPtr vert0,
                          BallPivotingVertexPtr vert1,
@@ -77,13 +105,40 @@ public:
         : vert0_(vert0),
           vert1_(vert1),
           vert2_(vert2),
-          ball_center_(ball_center) {}
+          ball_center_(ball_center),
+          index_(-1) {
+        //面の法線(vert0->vert1->vert2の順)と外接円半径の二乗を生成時に一度だけ計算しておく
+        normal_ = (vert1_->point_ - vert0_->point_)
+                          .cross(vert2_->point_ - vert0_->point_);
+        double norm = normal_.norm();
+        if (norm > 0) {
+            normal_ /= norm;
+        }
+        //球の中心は全頂点から等距離なので，頂点から球の中心へのベクトルの
+        //面に平行な成分の長さが外接円半径になる(ピタゴラスの定理)
+        Eigen::Vector3d offset = ball_center_ - vert0_->point_;
+        double height = offset.dot(normal_);
+        circ_radius2_ = offset.squaredNorm() - height * height;
+    }
+
+    //三角形がvert0->vert1->vert2と同じ回り順で(source, target)を持つか
+    bool IsSameWinding(const BallPivotingVertexPtr& source,
+                       const BallPivotingVertexPtr& target) const {
+        return (source == vert0_ && target == vert1_) ||
+               (source == vert1_ && target == vert2_) ||
+               (source == vert2_ && target == vert0_);
+    }
 
 public:
     BallPivotingVertexPtr vert0_;
     BallPivotingVertexPtr vert1_;
     BallPivotingVertexPtr vert2_;
     Eigen::Vector3d ball_center_;
+    //キャッシュした面の法線(単位ベクトル)と外接円半径の二乗
+    Eigen::Vector3d normal_;
+    double circ_radius2_;
+    //mesh_->triangles_の中でのインデックス
+    int index_;
 };
 
 
@@ -108,12 +163,34 @@ void BallPivotingVertex::UpdateType() {
 }
 
 
+//辺を追加する(すでにある場合は何もしない)．最初の追加で平均的な次数の分だけ確保し，
+//monotonicなメモリリソースで配列を伸ばすたびに古い領域が無駄になるのを防ぐ
+void BallPivotingVertex::AddEdge(const BallPivotingEdgePtr& edge) {
+    if (std::find(edges_.begin(), edges_.end(), edge) != edges_.end()) {
+        return;
+    }
+    if (edges_.capacity() == 0) {
+        edges_.reserve(8);
+    }
+    edges_.push_back(edge);
+}
+
+//辺を取り除く(順番は保たない)
+void BallPivotingVertex::RemoveEdge(const BallPivotingEdgePtr& edge) {
+    auto it = std::find(edges_.begin(), edges_.end(), edge);
+    if (it != edges_.end()) {
+        *it = edges_.back();
+        edges_.pop_back();
+    }
+}
+
 //エッジ(BallPivotingEdge)に隣接する三角形を追加する.edge->AddAdjacentTriangle(triangle)のような形で使われる
 //エッジがどの三角形と隣接しているかをエッジ側が(triangle0やtriangle1として)記録するための関数
 //三角形ABCが出来た時点で辺AB,BC,CAは三角形ABCに隣接していると言える．なので辺ABのtriangle0は三角形ABCになる
 //そこに点Dが加わり，三角形BCDが出来たとすると，辺BCは三角形ABCと三角形BCDと隣接していることになる．
 //辺BCのtriangle0は三角形ABC，triangle1は三角形BCDとなる．
-void BallPivotingEdge::AddAdjacentTriangle(BallPivotingTrianglePtr triangle) {
+//すでに2つの三角形があるエッジに3つ目を追加しようとした(非多様体になる)場合はFalseを返す
+bool BallPivotingEdge::AddAdjacentTriangle(BallPivotingTrianglePtr triangle) {
     //すでに引数の三角形が辺のtriangle0又はtriangle1でない場合
     if (triangle != triangle0_ && triangle != triangle1_) {
         //triangle0がまだ登録されていない場合
@@ -122,15 +199,15 @@ void BallPivotingEdge::AddAdjacentTriangle(BallPivotingTrianglePtr triangle) {
             triangle0_ = triangle;
             type_ = Type::Front;
             // update orientation
+            //キャッシュした面の法線を使うので，ここでは外積も正規化も不要．
+            //(source, target, opp)の回り順が三角形と逆なら法線の向きも逆になる
             if (BallPivotingVertexPtr opp = GetOppositeVertex()) {
-                Eigen::Vector3d tr_norm =
-                        (target_->point_ - source_->point_)
-                                .cross(opp->point_ - source_->point_);
-                tr_norm /= tr_norm.norm();
-                Eigen::Vector3d pt_norm =
-                        source_->normal_ + target_->normal_ + opp->normal_;
-                pt_norm /= pt_norm.norm();
-                if (pt_norm.dot(tr_norm) < 0) {
+                double orientation = triangle->normal_.dot(
+                        source_->normal_ + target_->normal_ + opp->normal_);
+                if (!triangle->IsSameWinding(source_, target_)) {
+                    orientation = -orientation;
+                }
+                if (orientation < 0) {
                     std::swap(target_, source_);
                 }
             } else {
@@ -142,8 +219,10 @@ void BallPivotingEdge::AddAdjacentTriangle(BallPivotingTrianglePtr triangle) {
             type_ = Type::Inner;
         } else {
             utility::LogDebug("!!! This case should not happen");
+            return false;
         }
     }
+    return true;
 }
 
 //現在のエッジに対して反対側の頂点を取得するための関数，triangle0からtargetでもsourceでもない頂点を取得する
@@ -164,27 +243,537 @@ BallPivotingVertexPtr BallPivotingEdge::GetOppositeVertex() {
     }
 }
 
+//robust_predicates_用のフィルタ付き述語．
+//まず普通の浮動小数点で計算し，結果の絶対値が誤差の上限より大きければその符号をそのまま使う．
+//誤差の上限以下の場合だけ，Shewchukの展開(expansion)演算で符号を厳密に求め直す．
+namespace predicates {
+
+typedef std::vector<double> Expansion;
+
+//a + b = x + y を誤差なしで表す
+inline void TwoSum(double a, double b, double& x, double& y) {
+    x = a + b;
+    double bv = x - a;
+    double av = x - bv;
+    y = (a - av) + (b - bv);
+}
+
+//a * b = x + y を誤差なしで表す
+inline void TwoProduct(double a, double b, double& x, double& y) {
+    x = a * b;
+    y = std::fma(a, b, -x);
+}
+
+//a - bを誤差なしの2項の展開として返す
+inline Expansion Difference(double a, double b) {
+    double x, y;
+    TwoSum(a, -b, x, y);
+    return {y, x};
+}
+
+inline Expansion Sum(const Expansion& e, const Expansion& f) {
+    Expansion h = e;
+    for (double b : f) {
+        Expansion g;
+        g.reserve(h.size() + 1);
+        double q = b;
+        for (double hi : h) {
+            double x, y;
+            TwoSum(q, hi, x, y);
+            g.push_back(y);
+            q = x;
+        }
+        g.push_back(q);
+        h.swap(g);
+    }
+    return h;
+}
+
+inline Expansion Product(const Expansion& e, const Expansion& f) {
+    Expansion h;
+    for (double b : f) {
+        for (double ei : e) {
+            double x, y;
+            TwoProduct(ei, b, x, y);
+            h = Sum(h, {y, x});
+        }
+    }
+    return h;
+}
+
+inline Expansion Negate(Expansion e) {
+    for (double& ei : e) {
+        ei = -ei;
+    }
+    return e;
+}
+
+//展開は絶対値の小さい順に並んでいるので，最後の0でない項の符号が全体の符号になる
+inline int Sign(const Expansion& e) {
+    for (auto it = e.rbegin(); it != e.rend(); ++it) {
+        if (*it != 0.0) {
+            return *it > 0.0 ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+const double kEpsilon = DBL_EPSILON * 0.5;
+const double kOrient2dBound = (3.0 + 16.0 * kEpsilon) * kEpsilon;
+const double kOrient3dBound = (7.0 + 56.0 * kEpsilon) * kEpsilon;
+
+//(b - a)x(c - a)の符号．a, b, cが反時計回りなら正，一直線上なら0
+inline int Orient2d(double ax,
+                    double ay,
+                    double bx,
+                    double by,
+                    double cx,
+                    double cy) {
+    double left = (ax - cx) * (by - cy);
+    double right = (ay - cy) * (bx - cx);
+    double det = left - right;
+    double bound = kOrient2dBound * (std::abs(left) + std::abs(right));
+    if (det > bound || -det > bound) {
+        return det > 0 ? 1 : -1;
+    }
+    if (bound == 0.0) {
+        //両方の積が0なら差分のどれかが0なので厳密にも0(重複点でよく起きる)
+        return 0;
+    }
+    Expansion exact =
+            Sum(Product(Difference(ax, cx), Difference(by, cy)),
+                Negate(Product(Difference(ay, cy), Difference(bx, cx))));
+    return Sign(exact);
+}
+
+//a, b, c, dが作る四面体の符号付き体積の符号．同一平面上なら0
+inline int Orient3d(const Eigen::Vector3d& a,
+                    const Eigen::Vector3d& b,
+                    const Eigen::Vector3d& c,
+                    const Eigen::Vector3d& d) {
+    Eigen::Vector3d ad = a - d, bd = b - d, cd = c - d;
+    double bdxcdy = bd(0) * cd(1), cdxbdy = cd(0) * bd(1);
+    double cdxady = cd(0) * ad(1), adxcdy = ad(0) * cd(1);
+    double adxbdy = ad(0) * bd(1), bdxady = bd(0) * ad(1);
+    double det = ad(2) * (bdxcdy - cdxbdy) + bd(2) * (cdxady - adxcdy) +
+                 cd(2) * (adxbdy - bdxady);
+    double permanent =
+            (std::abs(bdxcdy) + std::abs(cdxbdy)) * std::abs(ad(2)) +
+            (std::abs(cdxady) + std::abs(adxcdy)) * std::abs(bd(2)) +
+            (std::abs(adxbdy) + std::abs(bdxady)) * std::abs(cd(2));
+    double bound = kOrient3dBound * permanent;
+    if (det > bound || -det > bound) {
+        return det > 0 ? 1 : -1;
+    }
+    if (bound == 0.0) {
+        return 0;
+    }
+    Expansion e[3][3];
+    for (int i = 0; i < 3; ++i) {
+        e[0][i] = Difference(a(i), d(i));
+        e[1][i] = Difference(b(i), d(i));
+        e[2][i] = Difference(c(i), d(i));
+    }
+    auto minor = [&](int i, int j) {
+        return Sum(Product(e[1][i], e[2][j]),
+                   Negate(Product(e[1][j], e[2][i])));
+    };
+    Expansion exact = Sum(Sum(Product(e[0][2], minor(0, 1)),
+                              Product(e[0][0], minor(1, 2))),
+                          Product(e[0][1], minor(2, 0)));
+    return Sign(exact);
+}
+
+//3点が厳密に一直線上にあるか．xy, yz, zxの3つの射影が全て0なら一直線上
+inline bool Collinear(const Eigen::Vector3d& a,
+                      const Eigen::Vector3d& b,
+                      const Eigen::Vector3d& c) {
+    for (int i = 0; i < 3; ++i) {
+        int j = (i + 1) % 3;
+        if (Orient2d(a(i), a(j), b(i), b(j), c(i), c(j)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//同一平面上の線分p0p1とq0q1が交差(接触も含む)するか．
+//平面の向きが0にならない座標平面へ射影して2次元で判定する
+inline bool CoplanarSegmentsIntersect(const Eigen::Vector3d& p0,
+                                      const Eigen::Vector3d& p1,
+                                      const Eigen::Vector3d& q0,
+                                      const Eigen::Vector3d& q1,
+                                      const Eigen::Vector3d& plane_normal) {
+    int drop = 0;
+    plane_normal.cwiseAbs().maxCoeff(&drop);
+    int i = (drop + 1) % 3, j = (drop + 2) % 3;
+    auto orient = [&](const Eigen::Vector3d& a, const Eigen::Vector3d& b,
+                      const Eigen::Vector3d& c) {
+        return Orient2d(a(i), a(j), b(i), b(j), c(i), c(j));
+    };
+    auto on_segment = [&](const Eigen::Vector3d& a, const Eigen::Vector3d& b,
+                          const Eigen::Vector3d& c) {
+        return std::min(a(i), b(i)) <= c(i) && c(i) <= std::max(a(i), b(i)) &&
+               std::min(a(j), b(j)) <= c(j) && c(j) <= std::max(a(j), b(j));
+    };
+    int d0 = orient(q0, q1, p0), d1 = orient(q0, q1, p1);
+    int d2 = orient(p0, p1, q0), d3 = orient(p0, p1, q1);
+    if (d0 * d1 < 0 && d2 * d3 < 0) {
+        return true;
+    }
+    return (d0 == 0 && on_segment(q0, q1, p0)) ||
+           (d1 == 0 && on_segment(q0, q1, p1)) ||
+           (d2 == 0 && on_segment(p0, p1, q0)) ||
+           (d3 == 0 && on_segment(p0, p1, q1));
+}
+
+}  // namespace predicates
+
+//三角形をファイルに書き出すときのブロックの圧縮．
+//ブロックは[三角形数(uint32), 法線の有無(uint8), バイト数(uint32), 本体]で，本体は頂点インデックスを
+//1つ前のインデックスとの差分にしてzigzag + 可変長(7bitずつ)で符号化する．続く三角形は頂点を共有するので差分は小さい．
+//法線は頂点から計算し直す．CreateTriangleで面の法線と逆の回り順で出力した三角形は
+//最初の差分の最下位ビットに印をつけ，元の順で計算し直す(同じ計算なのでビット単位で一致する)
+namespace spill {
+
+inline void PutVarint(uint64_t value, std::vector<uint8_t>& bytes) {
+    while (value >= 0x80) {
+        bytes.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    bytes.push_back(static_cast<uint8_t>(value));
+}
+
+//終端のバイトが来る前にendに達した場合や64bitを超える場合はFalseを返す
+inline bool GetVarint(const uint8_t*& p, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline uint64_t ZigZag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^
+           static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t UnZigZag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+//CreateTriangleの面の法線と同じ計算
+inline Eigen::Vector3d FaceNormal(const Eigen::Vector3d& v0,
+                                  const Eigen::Vector3d& v1,
+                                  const Eigen::Vector3d& v2) {
+    Eigen::Vector3d normal = (v1 - v0).cross(v2 - v0);
+    double norm = normal.norm();
+    if (norm > 0) {
+        normal /= norm;
+    }
+    return normal;
+}
+
+inline void WriteBlock(std::ofstream& file,
+                       const std::vector<Eigen::Vector3i>& triangles,
+                       const std::vector<Eigen::Vector3d>& normals,
+                       const std::vector<Eigen::Vector3d>& vertices,
+                       std::vector<uint8_t>& bytes) {
+    bytes.clear();
+    const bool has_normals = !normals.empty();
+    int64_t prev = 0;
+    for (size_t tidx = 0; tidx < triangles.size(); ++tidx) {
+        const Eigen::Vector3i& t = triangles[tidx];
+        uint64_t flipped = 0;
+        if (has_normals) {
+            Eigen::Vector3d winding = (vertices[t(1)] - vertices[t(0)])
+                                              .cross(vertices[t(2)] -
+                                                     vertices[t(0)]);
+            flipped = normals[tidx].dot(winding) < 0 ? 1 : 0;
+        }
+        for (int k = 0; k < 3; ++k) {
+            uint64_t code = ZigZag(t(k) - prev);
+            PutVarint(k == 0 && has_normals ? (code << 1) | flipped : code,
+                      bytes);
+            prev = t(k);
+        }
+    }
+    uint32_t n_triangles = static_cast<uint32_t>(triangles.size());
+    uint8_t normals_flag = has_normals ? 1 : 0;
+    uint32_t n_bytes = static_cast<uint32_t>(bytes.size());
+    file.write(reinterpret_cast<const char*>(&n_triangles),
+               sizeof(n_triangles));
+    file.write(reinterpret_cast<const char*>(&normals_flag),
+               sizeof(normals_flag));
+    file.write(reinterpret_cast<const char*>(&n_bytes), sizeof(n_bytes));
+    file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+}  // namespace spill
+
+//未処理のFrontエッジの列．Lifoでは最後に作った辺から(元の実装のリスト)，
+//Mortonでは辺の中点のMortonコードが小さい辺から取り出す．Mortonでは続けて処理する辺が
+//空間的に近くなるので，近傍探索で触る点・頂点・辺がキャッシュに残りやすい．
+//ShortestEdgeでは短い辺から取り出す．同じキーの辺は後から入れた方を先に取り出す(Lifoと同じ)
+class BallPivotingFront {
+public:
+    BallPivotingFront(BallPivotingFrontOrder order,
+                      std::pmr::memory_resource* resource)
+        : order_(order), list_(resource), heap_(resource) {}
+
+    //Mortonコードを計算する範囲(有限な点のバウンディングボックス)
+    void SetBounds(const Eigen::Vector3d& min_bound,
+                   const Eigen::Vector3d& max_bound) {
+        origin_ = min_bound;
+        extent_ = (max_bound - min_bound).maxCoeff();
+    }
+    //Mortonコードのセルの一辺．同じセルの辺はLifoで続けて処理し，セルが空になったら
+    //コードが次に小さいセルへ移る．セルが細かすぎると前線があちこちに飛ぶ
+    void SetCellSize(double cell_size) {
+        scale_ = cell_size > 0 ? 1.0 / cell_size : 0.0;
+        if (extent_ > 0) {
+            scale_ = std::min(scale_, double(kCells - 1) / extent_);
+        }
+    }
+
+    void push_front(const BallPivotingEdgePtr& edge) {
+        if (order_ == BallPivotingFrontOrder::Lifo) {
+            list_.push_front(edge);
+        } else {
+            Push(edge);
+        }
+        if (size() >= compact_at_) {
+            Compact();
+        }
+    }
+    void push_back(const BallPivotingEdgePtr& edge) {
+        if (order_ == BallPivotingFrontOrder::Lifo) {
+            list_.push_back(edge);
+        } else {
+            Push(edge);
+        }
+        if (size() >= compact_at_) {
+            Compact();
+        }
+    }
+    const BallPivotingEdgePtr& front() const {
+        return order_ == BallPivotingFrontOrder::Lifo ? list_.front()
+                                                      : heap_.front().edge;
+    }
+    void pop_front() {
+        if (order_ == BallPivotingFrontOrder::Lifo) {
+            list_.pop_front();
+        } else {
+            std::pop_heap(heap_.begin(), heap_.end(), Later);
+            heap_.pop_back();
+        }
+    }
+    bool empty() const { return size() == 0; }
+    size_t size() const {
+        return order_ == BallPivotingFrontOrder::Lifo ? list_.size()
+                                                      : heap_.size();
+    }
+    //Frontではなくなった辺(取り出しても読み飛ばすだけの辺)を取り除く．
+    //辺はExpandTriangulationの途中でFrontに戻らないので，取り出す順は変わらない．
+    //取り除くと辺(とrelease_interior_で解放したい三角形)への参照も切れる．
+    //取り除いた後の2倍の大きさになったら次を行うので，pushあたり定数時間になる
+    void Compact() {
+        size_t before = size();
+        auto stale = [](const BallPivotingEdgePtr& edge) {
+            return edge->type_ != BallPivotingEdge::Front;
+        };
+        if (order_ == BallPivotingFrontOrder::Lifo) {
+            list_.remove_if(stale);
+        } else {
+            heap_.erase(std::remove_if(heap_.begin(), heap_.end(),
+                                       [&stale](const Entry& entry) {
+                                           return stale(entry.edge);
+                                       }),
+                        heap_.end());
+            std::make_heap(heap_.begin(), heap_.end(), Later);
+        }
+        n_compacted_ += before - size();
+        compact_at_ = std::max(2 * size(), kMinCompact);
+    }
+    //Compactで取り除いた辺の数
+    size_t NumCompacted() const { return n_compacted_; }
+
+    //確保しているバイト数の見積もり(nodeはリストの1要素のオーバーヘッド)
+    size_t Bytes(size_t node) const {
+        return list_.size() * (node + sizeof(BallPivotingEdgePtr)) +
+               heap_.capacity() * sizeof(Entry);
+    }
+
+private:
+    struct Entry {
+        uint64_t key;
+        uint64_t seq;
+        BallPivotingEdgePtr edge;
+    };
+    //std::*_heapは最大ヒープなので，キーが小さい(同じなら新しい)方を「大きい」とする
+    static bool Later(const Entry& a, const Entry& b) {
+        return a.key != b.key ? a.key > b.key : a.seq < b.seq;
+    }
+
+    void Push(const BallPivotingEdgePtr& edge) {
+        heap_.push_back({Key(edge), seq_++, edge});
+        std::push_heap(heap_.begin(), heap_.end(), Later);
+    }
+
+    uint64_t Key(const BallPivotingEdgePtr& edge) const {
+        if (order_ == BallPivotingFrontOrder::ShortestEdge) {
+            //正のdoubleはビット列を符号なし整数として比べても同じ順になる
+            double length2 =
+                    (edge->target_->point_ - edge->source_->point_)
+                            .squaredNorm();
+            uint64_t key;
+            std::memcpy(&key, &length2, sizeof(key));
+            return key;
+        }
+        //1軸21bitに量子化した中点の座標のビットを交互に並べる
+        Eigen::Vector3d mid =
+                (0.5 * (edge->source_->point_ + edge->target_->point_) -
+                 origin_) *
+                scale_;
+        uint64_t key = 0;
+        for (int axis = 0; axis < 3; ++axis) {
+            uint64_t cell = static_cast<uint64_t>(
+                    std::min(std::max(mid(axis), 0.0), double(kCells - 1)));
+            key |= Spread(cell) << axis;
+        }
+        return key;
+    }
+    static uint64_t Spread(uint64_t x) {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffULL;
+        x = (x | x << 16) & 0x1f0000ff0000ffULL;
+        x = (x | x << 8) & 0x100f00f00f00f00fULL;
+        x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+        x = (x | x << 2) & 0x1249249249249249ULL;
+        return x;
+    }
+
+    static constexpr uint64_t kCells = uint64_t(1) << 21;
+    static constexpr size_t kMinCompact = 4096;
+    BallPivotingFrontOrder order_;
+    std::pmr::list<BallPivotingEdgePtr> list_;
+    std::pmr::vector<Entry> heap_;
+    uint64_t seq_ = 0;
+    size_t compact_at_ = kMinCompact;
+    size_t n_compacted_ = 0;
+    Eigen::Vector3d origin_ = Eigen::Vector3d::Zero();
+    double extent_ = 0.0;
+    double scale_ = 0.0;
+};
+
+//上流のmemory_resourceから確保しているバイト数と，その最大値を数える
+class BallPivotingCountingResource : public std::pmr::memory_resource {
+public:
+    explicit BallPivotingCountingResource(std::pmr::memory_resource* upstream)
+        : upstream_(upstream) {}
+
+    size_t Live() const { return live_; }
+    size_t Peak() const { return peak_; }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        void* ptr = upstream_->allocate(bytes, alignment);
+        live_ += bytes;
+        peak_ = std::max(peak_, live_);
+        return ptr;
+    }
+    void do_deallocate(void* ptr, size_t bytes, size_t alignment) override {
+        upstream_->deallocate(ptr, bytes, alignment);
+        live_ -= bytes;
+    }
+    bool do_is_equal(
+            const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    std::pmr::memory_resource* upstream_;
+    size_t live_ = 0;
+    size_t peak_ = 0;
+};
+
+//出力する属性(三角形の法線，頂点の法線，頂点の色)ごとに特殊化する．使わない属性は
+//コピーも参照もせず，CreateTriangleなどの分岐もコンパイル時に消える．
+//どの特殊化を使うかはReconstructBallPivotingで実行時に選ぶ(DispatchBallPivoting)
+template <bool kTriangleNormals, bool kVertexNormals, bool kVertexColors>
 class BallPivoting {
 public:
-    BallPivoting(const PointCloud& pcd)//コンストラクタ関数，インスタンスが生成されるだけで実行される関数
-        : has_normals_(pcd.HasNormals()), kdtree_(pcd) {
+    BallPivoting(const PointCloud& pcd, const BallPivotingOption& option)//コンストラクタ関数，インスタンスが生成されるだけで実行される関数
+        : upstream_(option.memory_resource_ != nullptr
+                            ? option.memory_resource_
+                            : std::pmr::new_delete_resource()),
+          resource_(option.memory_resource_ != nullptr
+                            ? static_cast<std::pmr::memory_resource*>(
+                                      &upstream_)
+                            : option.release_interior_ &&
+                                              !option.output_half_edges_
+                                      ? static_cast<std::pmr::memory_resource*>(
+                                                &pool_)
+                                      : &arena_),
+          has_normals_(pcd.HasNormals()),
+          option_(option) {
+        //半辺の出力は頂点の辺の集合を使うので，そのときは解放しない
+        if (option_.output_half_edges_) {
+            option_.release_interior_ = false;
+        }
+        //画素の並びを持つ点群の場合は近傍を画素の窓から求めるので，KDTreeは作らない
+        if (option_.organized_width_ > 0) {
+            if (pcd.points_.size() % option_.organized_width_ != 0) {
+                utility::LogError(
+                        "organized_width_ {:d} does not divide the number of "
+                        "points {:d}",
+                        option_.organized_width_, pcd.points_.size());
+            }
+            if (option_.organized_window_ < 0) {
+                utility::LogError("organized_window_ {:d} has to be at least 0",
+                                  option_.organized_window_);
+            }
+        } else {
+            kdtree_.SetGeometry(pcd);
+        }
         mesh_ = std::make_shared<TriangleMesh>();//make_shardはインスタンス生成関数
         mesh_->vertices_ = pcd.points_;
-        mesh_->vertex_normals_ = pcd.normals_;
-        mesh_->vertex_colors_ = pcd.colors_;
+        //出力しない属性はコピーしない(頂点の法線はBallPivotingVertexがpcdのものを直接参照する)
+        if constexpr (kVertexNormals) {
+            mesh_->vertex_normals_ = pcd.normals_;
+        }
+        if constexpr (kVertexColors) {
+            mesh_->vertex_colors_ = pcd.colors_;
+        }
+        //頂点はまとめて確保する(reserveしてあるので頂点のポインタは動かない)
+        vertex_storage_.reserve(pcd.points_.size());
+        vertices.reserve(pcd.points_.size());
         for (size_t vidx = 0; vidx < pcd.points_.size(); ++vidx) {
-            vertices.emplace_back(new BallPivotingVertex(static_cast<int>(vidx),
-                                                         pcd.points_[vidx],
-                                                         pcd.normals_[vidx]));
+            vertex_storage_.emplace_back(static_cast<int>(vidx),
+                                         pcd.points_[vidx], pcd.normals_[vidx],
+                                         resource_);
+            vertices.push_back(&vertex_storage_.back());
         }
-    }
-
-    virtual ~BallPivoting() {
-        for (auto vert : vertices) {
-            delete vert;
+        if (option_.front_order_ == BallPivotingFrontOrder::Morton) {
+            Eigen::Vector3d min_bound = Eigen::Vector3d::Constant(DBL_MAX);
+            Eigen::Vector3d max_bound = Eigen::Vector3d::Constant(-DBL_MAX);
+            for (const Eigen::Vector3d& point : pcd.points_) {
+                if (point.allFinite()) {
+                    min_bound = min_bound.cwiseMin(point);
+                    max_bound = max_bound.cwiseMax(point);
+                }
+            }
+            if (min_bound(0) <= max_bound(0)) {
+                edge_front_.SetBounds(min_bound, max_bound);
+            }
         }
     }
 
+    virtual ~BallPivoting() {}
+
     //3頂点と球の半径と計算された球の中心座標が格納されるcenterを引数とし，
     //球の中心座標を計算して，計算できたかどうかをBool値で返す．
     //結果的に外接円半径が球半径(radius)より大きい場合Falseを返す
@@ -197,6 +786,10 @@ public:
         const Eigen::Vector3d& v1 = vertices[vidx1]->point_;
         const Eigen::Vector3d& v2 = vertices[vidx2]->point_;
         const Eigen::Vector3d& v3 = vertices[vidx3]->point_;
+        if (option_.robust_predicates_) {
+            return ComputeBallCenterRobust(vidx1, vidx2, vidx3, radius,
+                                           center);
+        }
         //頂点間の距離の二乗を計算する．
         double c = (v2 - v1).squaredNorm();
         double b = (v1 - v3).squaredNorm();
@@ -260,6 +853,174 @@ public:
         return false;
     }
 
+    //robust_predicates_の場合のComputeBallCenter．
+    //射影係数の合計をabg < 1e-16で判定する代わりに，3点が厳密に一直線上かどうかを述語で判定する．
+    //外接円の中心はv1を原点とした式で求める(ヘロンの公式より細長い三角形で桁落ちしにくい)
+    bool ComputeBallCenterRobust(int vidx1,
+                                 int vidx2,
+                                 int vidx3,
+                                 double radius,
+                                 Eigen::Vector3d& center) {
+        const Eigen::Vector3d& v1 = vertices[vidx1]->point_;
+        const Eigen::Vector3d& v2 = vertices[vidx2]->point_;
+        const Eigen::Vector3d& v3 = vertices[vidx3]->point_;
+        if (predicates::Collinear(v1, v2, v3)) {
+            return false;
+        }
+        Eigen::Vector3d ab = v2 - v1;
+        Eigen::Vector3d ac = v3 - v1;
+        Eigen::Vector3d n = ab.cross(ac);
+        double n2 = n.squaredNorm();
+        if (n2 == 0.0) {
+            //一直線上ではないが外積がアンダーフローした場合
+            return false;
+        }
+        Eigen::Vector3d to_circ_center = (ac.squaredNorm() * n.cross(ab) +
+                                          ab.squaredNorm() * ac.cross(n)) /
+                                         (2.0 * n2);
+        double height = radius * radius - to_circ_center.squaredNorm();
+        if (height < 0.0) {
+            return false;
+        }
+        Eigen::Vector3d tr_norm = n / std::sqrt(n2);
+        Eigen::Vector3d pt_norm = vertices[vidx1]->normal_ +
+                                  vertices[vidx2]->normal_ +
+                                  vertices[vidx3]->normal_;
+        if (tr_norm.dot(pt_norm) < 0) {
+            tr_norm *= -1;
+        }
+        center = v1 + to_circ_center + std::sqrt(height) * tr_norm;
+        return true;
+    }
+
+    //新しい三角形(src, tgt, candidate)が辺の既存の三角形(src, tgt, opp)と交差するか．
+    //robust_predicates_の場合は同一平面の判定と線分の交差判定を厳密な符号で行う
+    bool IntersectsTriangle(const BallPivotingVertexPtr& src,
+                            const BallPivotingVertexPtr& tgt,
+                            const BallPivotingVertexPtr& opp,
+                            const BallPivotingVertexPtr& candidate,
+                            const Eigen::Vector3d& mp) {
+        if (option_.robust_predicates_) {
+            if (predicates::Orient3d(src->point_, tgt->point_, opp->point_,
+                                     candidate->point_) != 0) {
+                return false;
+            }
+            Eigen::Vector3d plane_normal = (tgt->point_ - src->point_)
+                                                   .cross(opp->point_ -
+                                                          src->point_);
+            if (plane_normal.squaredNorm() > 0.0) {
+                return predicates::CoplanarSegmentsIntersect(
+                               mp, candidate->point_, src->point_,
+                               opp->point_, plane_normal) ||
+                       predicates::CoplanarSegmentsIntersect(
+                               mp, candidate->point_, tgt->point_,
+                               opp->point_, plane_normal);
+            }
+            //辺の三角形自体が潰れている場合は距離での判定に任せる
+        }
+        bool coplanar = IntersectionTest::PointsCoplanar(
+                src->point_, tgt->point_, opp->point_, candidate->point_);//引数の4点が同一平面上に存在するか．存在する場合はTrueを返す
+        //各線分の最短距離が閾値未満か(つまり新たに生成される三角形が既存の三角形と交差市中を判定)，各点が同一平面上にあるかを判定
+        return coplanar && (IntersectionTest::LineSegmentsMinimumDistance(
+                                    mp, candidate->point_, src->point_,
+                                    opp->point_) < 1e-12 ||
+                            IntersectionTest::LineSegmentsMinimumDistance(
+                                    mp, candidate->point_, tgt->point_,
+                                    opp->point_) < 1e-12);
+    }
+
+    //robust_predicates_の場合，三角形の頂点と全く同じ座標の点は球面上にあるので球の中には入らない．
+    //距離を計算して半径と比べると丸め誤差次第で中に入ったり入らなかったりするので，座標の一致で判定する
+    bool IsDuplicateOf(const BallPivotingVertexPtr& v,
+                       const BallPivotingVertexPtr& v0,
+                       const BallPivotingVertexPtr& v1,
+                       const BallPivotingVertexPtr& v2) {
+        return option_.robust_predicates_ &&
+               (v->point_ == v0->point_ || v->point_ == v1->point_ ||
+                v->point_ == v2->point_);
+    }
+
+    //既存の三角形に対して，新しい半径の球の中心座標を計算する．
+    //三角形にキャッシュした法線と外接円半径の二乗を使うので，
+    //外接円半径が球半径より大きい場合は計算なしでFalseを返す．
+    bool ComputeBallCenter(const BallPivotingTrianglePtr& triangle,
+                           double radius,
+                           Eigen::Vector3d& center) {
+        double height = radius * radius - triangle->circ_radius2_;
+        if (height < 0.0) {
+            return false;
+        }
+        //前の球の中心を面に射影すると外接円の中心になる．
+        //前の球の中心がある側が面の法線の向き(頂点法線と同じ側)になる
+        const Eigen::Vector3d& normal = triangle->normal_;
+        double old_height =
+                (triangle->ball_center_ - triangle->vert0_->point_).dot(normal);
+        Eigen::Vector3d circ_center =
+                triangle->ball_center_ - old_height * normal;
+        double side = old_height;
+        if (side == 0.0) {
+            side = normal.dot(triangle->vert0_->normal_ +
+                              triangle->vert1_->normal_ +
+                              triangle->vert2_->normal_);
+        }
+        center = circ_center + (side < 0 ? -1.0 : 1.0) * std::sqrt(height) *
+                                       normal;
+        return true;
+    }
+
+    //queryから半径radius以内の点を探す．結果はKDTreeFlann::SearchRadiusと同じく距離の近い順．
+    //organized_width_が指定されている場合はKDTreeを使わず，queryの近くにある点anchorの画素を中心とした
+    //(2 * window_ + 1)^2画素の窓だけを調べる(点の数によらず一定時間)．
+    //欠損した画素の点(NaN)は距離の比較がFalseになるので結果に入らない．
+    //窓の縁(画像の端ではない)の画素が半径内にあれば窓が小さすぎるので，一度だけ警告する
+    //(窓の外にも半径内の点がある可能性が高く，球が空に見えてしまう)
+    void SearchNeighbors(const Eigen::Vector3d& query,
+                         int anchor,
+                         double radius,
+                         std::vector<int>& indices,
+                         std::vector<double>& dists2) {
+        if (option_.organized_width_ <= 0) {
+            kdtree_.SearchRadius(query, radius, indices, dists2);
+            return;
+        }
+        const int width = option_.organized_width_;
+        const int height = static_cast<int>(vertices.size()) / width;
+        const int window = window_;
+        const int row = anchor / width, col = anchor % width;
+        const double radius2 = radius * radius;
+        std::vector<std::pair<double, int>>& found = scratch_.found;
+        found.clear();
+        bool truncated = false;
+        for (int r = std::max(row - window, 0);
+             r <= std::min(row + window, height - 1); ++r) {
+            const bool border_row = r == row - window || r == row + window;
+            for (int c = std::max(col - window, 0);
+                 c <= std::min(col + window, width - 1); ++c) {
+                int idx = r * width + c;
+                double dist2 = (vertices[idx]->point_ - query).squaredNorm();
+                if (dist2 <= radius2) {
+                    found.emplace_back(dist2, idx);
+                    truncated |= border_row || c == col - window ||
+                                 c == col + window;
+                }
+            }
+        }
+        if (truncated && !warned_window_) {
+            utility::LogWarning(
+                    "organized window of {:d} pixels does not cover the "
+                    "query radius {:.4f}; increase organized_window_",
+                    window, radius);
+            warned_window_ = true;
+        }
+        std::sort(found.begin(), found.end());
+        indices.resize(found.size());
+        dists2.resize(found.size());
+        for (size_t i = 0; i < found.size(); ++i) {
+            dists2[i] = found[i].first;
+            indices[i] = found[i].second;
+        }
+    }
+
     //与えられた頂点から辺を生成
     BallPivotingEdgePtr GetLinkingEdge(const BallPivotingVertexPtr& v0,
                                        const BallPivotingVertexPtr& v1) {
@@ -274,60 +1035,209 @@ public:
         return nullptr;
     }
 
+    //辺をresource_から確保する
+    BallPivotingEdgePtr NewEdge(const BallPivotingVertexPtr& source,
+                                const BallPivotingVertexPtr& target) {
+        ++n_edges_;
+        return std::allocate_shared<BallPivotingEdge>(
+                std::pmr::polymorphic_allocator<BallPivotingEdge>(resource_),
+                source, target);
+    }
+
     //与えられた3点から3次元メッシュを生成，またここで生成した三角形の各辺に各triangle0やtriangle1を登録する．
+    //keep_windingがTrueの場合は頂点法線で向きを決めずにv0->v1->v2の順のまま出力する(穴埋め用)
     void CreateTriangle(const BallPivotingVertexPtr& v0,
                         const BallPivotingVertexPtr& v1,
                         const BallPivotingVertexPtr& v2,
-                        const Eigen::Vector3d& center) {
+                        const Eigen::Vector3d& center,
+                        bool keep_winding = false) {
         utility::LogDebug(
                 "[CreateTriangle] with v0.idx={}, v1.idx={}, v2.idx={}",
                 v0->idx_, v1->idx_, v2->idx_);
         BallPivotingTrianglePtr triangle =
-                std::make_shared<BallPivotingTriangle>(v0, v1, v2, center);//新しいインスタンスを生成
+                std::allocate_shared<BallPivotingTriangle>(
+                        std::pmr::polymorphic_allocator<BallPivotingTriangle>(
+                                resource_),
+                        v0, v1, v2, center);
+        ++n_triangles_;//新しいインスタンスを生成
 
         BallPivotingEdgePtr e0 = GetLinkingEdge(v0, v1);//エッジ生成
         if (e0 == nullptr) {
-            e0 = std::make_shared<BallPivotingEdge>(v0, v1);
+            e0 = NewEdge(v0, v1);
         }
         //エッジを三角形に登録する．triangle0やtraingle1を生成してエッジ側に記録させる．
-        e0->AddAdjacentTriangle(triangle);
-        v0->edges_.insert(e0);
-        v1->edges_.insert(e0);
+        if (!e0->AddAdjacentTriangle(triangle)) {
+            non_manifold_edges_.emplace_back(e0->source_->idx_,
+                                             e0->target_->idx_);
+        }
+        v0->AddEdge(e0);
+        v1->AddEdge(e0);
 
         BallPivotingEdgePtr e1 = GetLinkingEdge(v1, v2);//エッジ生成
         if (e1 == nullptr) {
-            e1 = std::make_shared<BallPivotingEdge>(v1, v2);
+            e1 = NewEdge(v1, v2);
         }
         //エッジを三角形に登録する．triangle0やtraingle1を生成してエッジ側に記録させる．
-        e1->AddAdjacentTriangle(triangle);
-        v1->edges_.insert(e1);
-        v2->edges_.insert(e1);
+        if (!e1->AddAdjacentTriangle(triangle)) {
+            non_manifold_edges_.emplace_back(e1->source_->idx_,
+                                             e1->target_->idx_);
+        }
+        v1->AddEdge(e1);
+        v2->AddEdge(e1);
 
         BallPivotingEdgePtr e2 = GetLinkingEdge(v2, v0);//エッジ生成
         if (e2 == nullptr) {
-            e2 = std::make_shared<BallPivotingEdge>(v2, v0);
+            e2 = NewEdge(v2, v0);
         }
         //エッジを三角形に登録する．triangle0やtraingle1を生成してエッジ側に記録させる．
-        e2->AddAdjacentTriangle(triangle);
-        v2->edges_.insert(e2);
-        v0->edges_.insert(e2);
+        if (!e2->AddAdjacentTriangle(triangle)) {
+            non_manifold_edges_.emplace_back(e2->source_->idx_,
+                                             e2->target_->idx_);
+        }
+        v2->AddEdge(e2);
+        v0->AddEdge(e2);
 
         //頂点のタイプ更新
         v0->UpdateType();
         v1->UpdateType();
         v2->UpdateType();
 
-        Eigen::Vector3d face_normal =
-                ComputeFaceNormal(v0->point_, v1->point_, v2->point_);//面の法線ベクトルを求める
+        const Eigen::Vector3d& face_normal = triangle->normal_;//三角形生成時に計算済みの面の法線ベクトル
         //計算した面法線と頂点法線がある程度同じ向きにするための処理，頂点の追加順で三角形の法線向きが変わる
-        if (face_normal.dot(v0->normal_) > -1e-16) {//面の法線と頂点v0の法線が同じ方向を向いている場合
+        triangle->index_ = static_cast<int>(NumTriangles());
+        if (keep_winding || face_normal.dot(v0->normal_) > -1e-16) {//面の法線と頂点v0の法線が同じ方向を向いている場合
             mesh_->triangles_.emplace_back(
                     Eigen::Vector3i(v0->idx_, v1->idx_, v2->idx_));//新しい三角形を追加
         } else {//面の法線と頂点v0の法線が同じ方向を向いていない場合
             mesh_->triangles_.emplace_back(
                     Eigen::Vector3i(v0->idx_, v2->idx_, v1->idx_));//新しい三角形を追加
         }
-        mesh_->triangle_normals_.push_back(face_normal);//法線を追加
+        if constexpr (kTriangleNormals) {
+            mesh_->triangle_normals_.push_back(face_normal);//法線を追加
+        }
+        if (!option_.spill_path_.empty() &&
+            mesh_->triangles_.size() >= option_.spill_block_triangles_) {
+            SpillTriangles();
+        }
+
+        if (option_.release_interior_) {
+            //ローカルの参照を先に切っておく．残っているとReleaseInteriorで
+            //この三角形のuse_count()が1にならず，n_triangles_が減らない
+            triangle.reset();
+            ReleaseInterior(v0);
+            ReleaseInterior(v1);
+            ReleaseInterior(v2);
+        }
+    }
+
+    //Innerになった頂点vと，もう一方の端点もInnerの辺を解放する．
+    //そういう辺はもう回転にも探索にも使われない(Innerの頂点は候補点にもシードにもならない)．
+    //三角形は3辺から参照されているので，3頂点ともInnerになって3辺とも解放されたときに解放される．
+    //出力の三角形(インデックス)はmesh_に残る
+    void ReleaseInterior(BallPivotingVertexPtr v) {
+        if (v->type_ != BallPivotingVertex::Type::Inner) {
+            return;
+        }
+        for (size_t i = 0; i < v->edges_.size();) {
+            BallPivotingEdgePtr edge = v->edges_[i];
+            BallPivotingVertexPtr other =
+                    edge->source_ == v ? edge->target_ : edge->source_;
+            if (other->type_ != BallPivotingVertex::Type::Inner) {
+                ++i;
+                continue;
+            }
+            //最後の辺がi番目に来るのでiは進めない
+            v->RemoveEdge(edge);
+            other->RemoveEdge(edge);
+            ReleaseEdgeSet(other);
+            for (BallPivotingTrianglePtr* triangle :
+                 {&edge->triangle0_, &edge->triangle1_}) {
+                if (*triangle != nullptr && triangle->use_count() == 1) {
+                    --n_triangles_;
+                }
+                triangle->reset();
+            }
+            --n_edges_;
+        }
+        ReleaseEdgeSet(v);
+    }
+
+    //空になったInnerの頂点の辺の配列も解放する
+    void ReleaseEdgeSet(BallPivotingVertexPtr v) {
+        if (v->edges_.empty() && v->edges_.capacity() > 0) {
+            std::pmr::vector<BallPivotingEdgePtr>(resource_).swap(v->edges_);
+        }
+    }
+
+    //書き出した分も含めた三角形の数
+    size_t NumTriangles() const {
+        return n_spilled_ + mesh_->triangles_.size();
+    }
+
+    //mesh_にたまった三角形を1ブロックとしてspill_path_に書き出して消す
+    void SpillTriangles() {
+        if (mesh_->triangles_.empty()) {
+            return;
+        }
+        OpenSpillFile();
+        spill::WriteBlock(spill_file_, mesh_->triangles_,
+                          mesh_->triangle_normals_, mesh_->vertices_,
+                          spill_bytes_);
+        n_spilled_ += mesh_->triangles_.size();
+        mesh_->triangles_.clear();
+        mesh_->triangle_normals_.clear();
+    }
+
+    //spill_path_を空にして開く(既に開いていれば何もしない)
+    void OpenSpillFile() {
+        if (spill_file_.is_open()) {
+            return;
+        }
+        spill_file_.open(option_.spill_path_,
+                         std::ios::binary | std::ios::trunc);
+        if (!spill_file_) {
+            utility::LogError("Cannot open spill file {}",
+                              option_.spill_path_);
+        }
+    }
+
+    //最後のブロックを書き出し，必要なら全部読み戻してファイルを消す．
+    //三角形が1つもない場合も空のファイルを作る(前の実行で残ったファイルを読まないように)
+    void FinishSpill() {
+        SpillTriangles();
+        OpenSpillFile();
+        spill_file_.close();
+        utility::LogDebug("[FinishSpill] spilled {:d} triangles to {}",
+                          n_spilled_, option_.spill_path_);
+        if (!option_.spill_read_back_ && !option_.compact_output_ &&
+            !option_.output_half_edges_ && !option_.collapse_duplicates_) {
+            return;
+        }
+        if (n_spilled_ == 0) {
+            std::remove(option_.spill_path_.c_str());
+            return;
+        }
+        mesh_->triangles_.reserve(n_spilled_);
+        if constexpr (kTriangleNormals) {
+            mesh_->triangle_normals_.reserve(n_spilled_);
+        }
+        bool read = ReadBallPivotingSpill(
+                option_.spill_path_, mesh_->vertices_,
+                [this](const std::vector<Eigen::Vector3i>& triangles,
+                       const std::vector<Eigen::Vector3d>& normals) {
+                    mesh_->triangles_.insert(mesh_->triangles_.end(),
+                                             triangles.begin(),
+                                             triangles.end());
+                    mesh_->triangle_normals_.insert(
+                            mesh_->triangle_normals_.end(), normals.begin(),
+                            normals.end());
+                });
+        if (!read || mesh_->triangles_.size() != n_spilled_) {
+            utility::LogError("Cannot read back spill file {}",
+                              option_.spill_path_);
+        }
+        n_spilled_ = 0;
+        std::remove(option_.spill_path_.c_str());
     }
 
     //面の法線ベクトルを外積から求める
@@ -404,44 +1314,126 @@ public:
         Eigen::Vector3d a = center - mp;//中心ベクトルcneterから中点ベクトルmpへの方向ベクトル
         a /= a.norm();////方向ベクトルを正規化する．つまり方向ベクトルの大きさを計算し，単位ベクトルにする．
 
-        //最近傍探索の結果を格納するための配列を準備
-        std::vector<int> indices;
-        std::vector<double> dists2;
-        kdtree_.SearchRadius(mp, 2 * radius, indices, dists2);//mpを中心とした半径2*radiusの範囲内にある点を探索する．探索結果として範囲内点インデックスを配列indices，各点までの距離の2乗がdists2に格納される．
+        //src, tgtを通る球の中心はmpを中心とする半径R = sqrt(r^2 - |e|^2 / 4)の円(vに垂直な面)の上にある．
+        //候補点も空の球の判定に使う点も，この円上の中心から距離r以内なので，mpからR + r以内にある(R <= rなので2r以下)
+        const Eigen::Vector3d e = tgt->point_ - src->point_;
+        const double ring2 = radius * radius - 0.25 * e.squaredNorm();
+        const double ring = std::sqrt(std::max(ring2, 0.0));
+
+        //最近傍探索の結果を格納するための配列を準備(使い回す)
+        std::vector<int>& indices = scratch_.indices;
+        std::vector<double>& dists2 = scratch_.dists2;
+        SearchNeighbors(mp, src->idx_, ring + radius, indices, dists2);//mpを中心とした半径R + radiusの範囲内にある点を探索する．探索結果として範囲内点インデックスを配列indices，各点までの距離の2乗がdists2に格納される．
         utility::LogDebug("[FindCandidateVertex] found {} potential candidates",
                           indices.size());
-
-        BallPivotingVertexPtr min_candidate = nullptr;
-        double min_angle = 2 * M_PI;//2πを準備
-        //探索した点をループで調べる
+        candidate_counts_.searched += indices.size();
+
+        //球の中心の計算より前に，候補点全体に対してIsCompatible(candidate, src, tgt)と
+        //同じ法線の向きの判定をまとめて行う．候補点ごとの面の法線は
+        //(src - p)x(tgt - p) = (src - p)x(tgt - src) で，差をとってから外積を計算する
+        //(src x tgtのように絶対座標の外積を使うと，原点から遠い点群で桁落ちする)．
+        //ここで落としておけば，向きの合わない点が勝ち残って辺がBorderになることもない．
+        //球が触れられるのは中心の円から距離r以内(トーラスの中)の点だけで，それ以外は
+        //ComputeBallCenterが必ずFalseになるので，法線の判定より前にまとめて除外する
+        const Eigen::Vector3d u = v.cross(a);
+        const double torus2 = radius * radius * (1 + 1e-12);
+        std::vector<int>& compatible = scratch_.compatible;
+        compatible.clear();
         for (auto nbidx : indices) {
-            utility::LogDebug("[FindCandidateVertex] nbidx {:d}", nbidx);
-            const BallPivotingVertexPtr& candidate = vertices[nbidx];//探索点を取得
-            //点がsrcでもtgtでもoppでもないかを調べる．一致したらcontinueする
+            const BallPivotingVertexPtr& candidate = vertices[nbidx];
+            //点がsrcでもtgtでもoppでもないかを調べる．一致したら除外する
             if (candidate->idx_ == src->idx_ || candidate->idx_ == tgt->idx_ ||
                 candidate->idx_ == opp->idx_) {
-                utility::LogDebug(
-                        "[FindCandidateVertex] candidate {:d} is a triangle "
-                        "vertex of the edge",
-                        candidate->idx_);
+                ++candidate_counts_.edge_vertices;
+                continue;
+            }
+            if (candidate->outlier_) {
+                ++candidate_counts_.outliers;
+                continue;
+            }
+            Eigen::Vector3d p = candidate->point_ - mp;
+            double d = p.dot(v);
+            double rho = std::sqrt(std::max(p.squaredNorm() - d * d, 0.0));
+            if (d * d + (rho - ring) * (rho - ring) > torus2) {
+                ++candidate_counts_.outside_torus;
                 continue;
             }
+            Eigen::Vector3d normal =
+                    (src->point_ - candidate->point_).cross(e);
+            double norm = normal.norm();
+            if (norm > 0) {
+                normal /= norm;
+            }
+            if (normal.dot(candidate->normal_) < -1e-16) {
+                normal *= -1;
+            }
+            if (normal.dot(candidate->normal_) > -1e-16 &&
+                normal.dot(src->normal_) > -1e-16 &&
+                normal.dot(tgt->normal_) > -1e-16) {
+                compatible.push_back(nbidx);
+            } else {
+                ++candidate_counts_.incompatible;
+            }
+        }
+        utility::LogDebug(
+                "[FindCandidateVertex] {} candidates have compatible normals",
+                compatible.size());
+
+        //回転角が小さい順に候補点を並べる．src, tgt, pを通る球の中心はmpを中心とする半径R = sqrt(r^2 - |e|^2 / 4)の
+        //円(vに垂直な面)の上にあり，候補点pを面に射影した角度phi_pと距離rho，面からの高さdから，
+        //円の上でpから距離rの2点 phi_p -+ acos((R^2 + rho^2 + d^2 - r^2) / (2 R rho)) が求まる．
+        //ComputeBallCenterはこのどちらかを返すので，小さい方が回転角の下限になる．
+        //下限の順に調べれば，下限がmin_angle以上になった時点で残りの候補点は球の中心の計算ごと省ける
+        std::vector<std::pair<double, int>>& ordered = scratch_.ordered;
+        ordered.clear();
+        for (auto nbidx : compatible) {
+            Eigen::Vector3d p = vertices[nbidx]->point_ - mp;
+            double d = p.dot(v);
+            double x = p.dot(a), y = p.dot(u);
+            double rho2 = x * x + y * y;
+            //球が触れない点(ComputeBallCenterがFalseになる点)は最後．下限が分からない点は0
+            double lower = rho2 > 0 ? 4 * M_PI : 0.0;
+            if (ring > 0 && rho2 > 0) {
+                double k = (ring2 + rho2 + d * d - radius * radius) /
+                           (2 * ring * std::sqrt(rho2));
+                if (k <= 1.0 + 1e-9) {
+                    double phi = std::atan2(y, x);
+                    double delta = std::acos(std::max(std::min(k, 1.0), -1.0));
+                    double first = std::fmod(phi - delta + 4 * M_PI, 2 * M_PI);
+                    double second = std::fmod(phi + delta + 4 * M_PI, 2 * M_PI);
+                    lower = std::min(first, second);
+                    //0付近は丸め誤差で2π付近になることがあるので下限を0にしておく
+                    if (std::max(first, second) > 2 * M_PI - 1e-9) {
+                        lower = 0.0;
+                    }
+                }
+            }
+            ordered.emplace_back(lower, nbidx);
+        }
+        std::sort(ordered.begin(), ordered.end());
+
+        BallPivotingVertexPtr min_candidate = nullptr;
+        double min_angle = 2 * M_PI;//2πを準備
+        //法線の判定を通った点を回転角の下限の小さい順に調べる
+        for (size_t order = 0; order < ordered.size(); ++order) {
+            //ここから先の候補点はmin_angle以上の角度にしかならない(丸め誤差の分だけ余裕を持たせる)
+            if (ordered[order].first - 1e-9 >= min_angle) {
+                candidate_counts_.ordered_out += ordered.size() - order;
+                break;
+            }
+            int nbidx = ordered[order].second;
+            utility::LogDebug("[FindCandidateVertex] nbidx {:d}", nbidx);
+            const BallPivotingVertexPtr& candidate = vertices[nbidx];//探索点を取得
             utility::LogDebug("[FindCandidateVertex] candidate={:d} => {}",
                               candidate->idx_, candidate->point_.transpose());
 
-            bool coplanar = IntersectionTest::PointsCoplanar(
-                    src->point_, tgt->point_, opp->point_, candidate->point_);//引数の4点が同一平面上に存在するか．存在する場合はTrueを返す
-            //各線分の最短距離が閾値未満か(つまり新たに生成される三角形が既存の三角形と交差市中を判定)，各点が同一平面上にあるかを判定，その場合はcontinue
-            if (coplanar && (IntersectionTest::LineSegmentsMinimumDistance(
-                                     mp, candidate->point_, src->point_,
-                                     opp->point_) < 1e-12 ||
-                             IntersectionTest::LineSegmentsMinimumDistance(
-                                     mp, candidate->point_, tgt->point_,
-                                     opp->point_) < 1e-12)) {
+            //新しい三角形が既存の三角形と交差する場合はcontinue
+            if (IntersectsTriangle(src, tgt, opp, candidate, mp)) {
                 utility::LogDebug(
                         "[FindCandidateVertex] candidate {:d} is intersecting "
                         "the existing triangle",
                         candidate->idx_);
+                ++candidate_counts_.intersecting;
                 continue;
             }
 
@@ -453,6 +1445,7 @@ public:
                         "[FindCandidateVertex] candidate {:d} can not compute "
                         "ball",
                         candidate->idx_);
+                ++candidate_counts_.no_ball;
                 continue;
             }
             utility::LogDebug("[FindCandidateVertex] candidate {:d} center={}",
@@ -491,9 +1484,11 @@ public:
                         "[FindCandidateVertex] candidate {:d} angle {:f} > "
                         "min_angle {:f}",
                         candidate->idx_, angle, min_angle);
+                ++candidate_counts_.larger_angle;
                 continue;
             }
 
+            ++candidate_counts_.empty_ball_tests;
             bool empty_ball = true;
             //範囲内の点をループで調べる
             for (auto nbidx2 : indices) {
@@ -503,6 +1498,9 @@ public:
                     nb->idx_ == candidate->idx_) {
                     continue;
                 }
+                if (IsDuplicateOf(nb, src, tgt, candidate)) {
+                    continue;
+                }
                 //範囲内点と新しい球の距離が一定範囲未満の場合
                 if ((new_center - nb->point_).norm() < radius - 1e-16) {
                     utility::LogDebug(
@@ -521,6 +1519,8 @@ public:
                 min_angle = angle;
                 min_candidate = vertices[nbidx];
                 candidate_center = new_center;
+            } else {
+                ++candidate_counts_.non_empty_ball;
             }
         }
 
@@ -543,17 +1543,26 @@ public:
             edge_front_.pop_front();//取り出したFrontエッジをリストから削除
             //取り出したエッジがFrontエッジではない場合
             if (edge->type_ != BallPivotingEdge::Front) {
+                ++front_counts_.stale;
                 continue;
             }
+            //続けて処理した辺の中点の間の距離(front_order_による局所性の目安)
+            Eigen::Vector3d mid =
+                    0.5 * (edge->source_->point_ + edge->target_->point_);
+            if (front_counts_.pops > 0) {
+                front_counts_.jump += (mid - front_counts_.last).norm();
+            }
+            front_counts_.last = mid;
+            ++front_counts_.pops;
 
             Eigen::Vector3d center;
             //Frontエッジから候補点を見つける
             BallPivotingVertexPtr candidate =
                     FindCandidateVertex(edge, radius, center);
-            //候補点がない場合か候補点タイプがInnerか新しい点が既存辺と接続可能ではない場合
+            //候補点がない場合か候補点タイプがInnerの場合
+            //(法線の向きはFindCandidateVertexの中で判定済み)
             if (candidate == nullptr ||
-                candidate->type_ == BallPivotingVertex::Type::Inner ||
-                !IsCompatible(candidate, edge->source_, edge->target_)) {
+                candidate->type_ == BallPivotingVertex::Type::Inner) {
                 edge->type_ = BallPivotingEdge::Type::Border;//辺タイプをボーダーにする
                 border_edges_.push_back(edge);//ボーダーエッジリストにエッジを追加
                 continue;
@@ -571,12 +1580,13 @@ public:
 
             CreateTriangle(edge->source_, edge->target_, candidate, center);
 
+            //release_interior_の場合，Innerになって解放された辺はnullptrになる
             e0 = GetLinkingEdge(candidate, edge->source_);
             e1 = GetLinkingEdge(candidate, edge->target_);
-            if (e0->type_ == BallPivotingEdge::Type::Front) {
+            if (e0 != nullptr && e0->type_ == BallPivotingEdge::Type::Front) {
                 edge_front_.push_front(e0);
             }
-            if (e1->type_ == BallPivotingEdge::Type::Front) {
+            if (e1 != nullptr && e1->type_ == BallPivotingEdge::Type::Front) {
                 edge_front_.push_front(e1);
             }
         }
@@ -635,6 +1645,9 @@ public:
                 v->idx_ == v2->idx_) {
                 continue;
             }
+            if (IsDuplicateOf(v, v0, v1, v2)) {
+                continue;
+            }
             //球の中心と頂点の距離を計算して，半径未満であれば球内にボールが存在するとみなして終了
             if ((center - v->point_).norm() < radius - 1e-16) {
                 utility::LogDebug(
@@ -649,22 +1662,114 @@ public:
         return true;
     }
 
+    //organized_window_ = 0の場合の窓の大きさ．近傍探索は窓の中心の画素から最大で
+    //(1 + sqrt(2)) * radius離れたところまで届く(FindCandidateVertexで辺の中点から，
+    //中点と端点の距離 + 中心の円の半径 + radius)ので，それを隣の画素との距離の中央値で割る．
+    //画素の間隔のばらつきの分として1画素足す
+    int EstimateOrganizedWindow(const std::vector<double>& radii) {
+        const int width = option_.organized_width_;
+        const size_t n_samples = 1024;
+        const size_t stride = std::max<size_t>(vertices.size() / n_samples, 1);
+        std::vector<double> pitches;
+        pitches.reserve(n_samples + 1);
+        for (size_t vidx = 0; vidx + 1 < vertices.size(); vidx += stride) {
+            if (static_cast<int>(vidx % width) == width - 1) {
+                continue;
+            }
+            double pitch = (vertices[vidx + 1]->point_ - vertices[vidx]->point_)
+                                   .norm();
+            if (std::isfinite(pitch) && pitch > 0) {
+                pitches.push_back(pitch);
+            }
+        }
+        double max_radius = 0.0;
+        for (double radius : radii) {
+            max_radius = std::max(max_radius, radius);
+        }
+        int window = 1;
+        if (!pitches.empty()) {
+            auto median = pitches.begin() + pitches.size() / 2;
+            std::nth_element(pitches.begin(), median, pitches.end());
+            double reach = (1 + std::sqrt(2.0)) * max_radius;
+            window = static_cast<int>(std::min(
+                    std::ceil(reach / *median) + 1,
+                    static_cast<double>(std::max(width, 1))));
+        }
+        window = std::max(window, 1);
+        utility::LogDebug("[EstimateOrganizedWindow] window={:d}", window);
+        return window;
+    }
+
+    //半径2*radius内の近傍点の数の基準値を，点群全体から等間隔に選んだ点の中央値で決める．
+    //シードの探索が進んだ後に残るのは境界やノイズの点ばかりなので，TrySeedに来た点だけで
+    //平均をとるとノイズに引きずられる．最初に固定の標本で決めておけばその影響を受けない
+    void EstimateNeighborCount(double radius) {
+        const size_t n_samples = 256;
+        const size_t stride =
+                std::max<size_t>(vertices.size() / n_samples, 1);
+        std::vector<size_t> counts;
+        counts.reserve(n_samples + 1);
+        for (size_t vidx = 0; vidx < vertices.size(); vidx += stride) {
+            const BallPivotingVertexPtr& v = vertices[vidx];
+            if (!v->point_.allFinite()) {
+                continue;
+            }
+            SearchNeighbors(v->point_, v->idx_, 2 * radius, scratch_.indices,
+                            scratch_.dists2);
+            counts.push_back(scratch_.indices.size());
+        }
+        reference_neighbor_count_ = 0.0;
+        if (!counts.empty()) {
+            auto median = counts.begin() + counts.size() / 2;
+            std::nth_element(counts.begin(), median, counts.end());
+            reference_neighbor_count_ = static_cast<double>(*median);
+        }
+        utility::LogDebug(
+                "[EstimateNeighborCount] median of {:d} samples: {:.1f}",
+                counts.size(), reference_neighbor_count_);
+    }
+
+    //TrySeedのSearchRadiusで得た近傍点の数(count)から，頂点vが外れ値かどうかを判定する．
+    //基準値(EstimateNeighborCount)のoutlier_ratio_倍より少なければ外れ値とする．
+    //外れ値の点はシードにも候補点にも使わない
+    bool ClassifyOutlier(const BallPivotingVertexPtr& v, size_t count) {
+        if (option_.outlier_ratio_ <= 0) {
+            return false;
+        }
+        if (static_cast<double>(count) <
+            option_.outlier_ratio_ * reference_neighbor_count_) {
+            utility::LogDebug(
+                    "[ClassifyOutlier] v.idx={} has {:d} neighbors, "
+                    "reference {:.1f}",
+                    v->idx_, count, reference_neighbor_count_);
+            v->outlier_ = true;
+            ++n_outliers_;
+            return true;
+        }
+        return false;
+    }
+
     //頂点と半径を引数とし，一番最初の三角形(シード三角形)の辺を見つけようとする
     //具体的な内容としてはフロントエッジを生成する．
     bool TrySeed(BallPivotingVertexPtr& v, double radius) {
         utility::LogDebug("[TrySeed] with v.idx={}, radius={}", v->idx_,
                           radius);
-        std::vector<int> indices;
-        std::vector<double> dists2;
-        kdtree_.SearchRadius(v->point_, 2 * radius, indices, dists2);//頂点から半径2*radius内頂点を探す
+        std::vector<int>& indices = scratch_.indices;
+        std::vector<double>& dists2 = scratch_.dists2;
+        SearchNeighbors(v->point_, v->idx_, 2 * radius, indices, dists2);//頂点から半径2*radius内頂点を探す
         if (indices.size() < 3u) {//発見頂点が3つ未満の場合
             return false;
         }
+        //近傍点の数から外れ値と判定した場合は，O(k^3)の探索をせずに終了
+        if (ClassifyOutlier(v, indices.size())) {
+            return false;
+        }
 
         //発見した頂点を順番にループで調べる．nbidx0の頂点を探す．
         for (size_t nbidx0 = 0; nbidx0 < indices.size(); ++nbidx0) {
             const BallPivotingVertexPtr& nb0 = vertices[indices[nbidx0]];
-            if (nb0->type_ != BallPivotingVertex::Type::Orphan) {
+            if (nb0->type_ != BallPivotingVertex::Type::Orphan ||
+                nb0->outlier_) {
                 //頂点タイプがOrphanの場合，つまりどのメッシュにも属していいない場合
                 continue;
             }
@@ -680,7 +1785,8 @@ public:
                  ++nbidx1) {
                 const BallPivotingVertexPtr& nb1 = vertices[indices[nbidx1]];
                 //頂点タイプがOrphanの場合，つまりどのメッシュにも属していいない場合
-                if (nb1->type_ != BallPivotingVertex::Type::Orphan) {
+                if (nb1->type_ != BallPivotingVertex::Type::Orphan ||
+                    nb1->outlier_) {
                     continue;
                 }
                 //発見した頂点が引数v頂点と同じ場合
@@ -725,16 +1831,19 @@ public:
                 e0 = GetLinkingEdge(v, nb1);
                 e1 = GetLinkingEdge(nb0, nb1);
                 e2 = GetLinkingEdge(v, nb0);
-                //e0のタイプがFrontの場合，Frontリストにe0を追加する．
-                if (e0->type_ == BallPivotingEdge::Type::Front) {
+                //e0のタイプがFrontの場合，Frontリストにe0を追加する．(解放された辺はnullptr)
+                if (e0 != nullptr &&
+                    e0->type_ == BallPivotingEdge::Type::Front) {
                     edge_front_.push_front(e0);
                 }
                 //e1のタイプがFrontの場合，Frontリストにe1を追加する．
-                if (e1->type_ == BallPivotingEdge::Type::Front) {
+                if (e1 != nullptr &&
+                    e1->type_ == BallPivotingEdge::Type::Front) {
                     edge_front_.push_front(e1);
                 }
                 //e2のタイプがFrontの場合，Frontリストにe2を追加する．
-                if (e2->type_ == BallPivotingEdge::Type::Front) {
+                if (e2 != nullptr &&
+                    e2->type_ == BallPivotingEdge::Type::Front) {
                     edge_front_.push_front(e2);
                 }
 
@@ -758,7 +1867,8 @@ public:
             utility::LogDebug("[FindSeedTriangle] with radius={}, vidx={}",
                               radius, vidx);
             //頂点のタイプがOrphan(メッシュの一部として使われていない)の場合
-            if (vertices[vidx]->type_ == BallPivotingVertex::Type::Orphan) {
+            if (vertices[vidx]->type_ == BallPivotingVertex::Type::Orphan &&
+                !vertices[vidx]->outlier_) {
                 //フロントエッジを見つけられた場合
                 if (TrySeed(vertices[vidx], radius)) {
                     ExpandTriangulation(radius);
@@ -767,12 +1877,440 @@ public:
         }
     }
 
-    std::shared_ptr<TriangleMesh> Run(const std::vector<double>& radii) {
+    //Borderエッジを辿って境界のループを作る．
+    //エッジの向きは隣接する三角形の回り順に揃っているので，あるエッジのtargetから出ているBorderエッジが次のエッジになる．
+    //1つの頂点から複数のBorderエッジが出ている(非多様体な)場合や，閉じない場合はループとして返さない
+    //入ってくるBorderエッジも1本だけの頂点しか通らないので，途中から閉じたループに合流することはない．
+    //ループにならなかったエッジはopen_edgesに入れる
+    std::vector<std::vector<BallPivotingVertexPtr>> CollectBorderLoops(
+            std::vector<BallPivotingEdgePtr>* open_edges = nullptr) {
+        std::unordered_map<BallPivotingVertexPtr,
+                           std::vector<BallPivotingEdgePtr>>
+                outgoing;
+        std::unordered_map<BallPivotingVertexPtr, int> n_incoming;
+        std::unordered_set<BallPivotingEdgePtr> visited;
+        for (const BallPivotingEdgePtr& edge : border_edges_) {
+            //ボーダーエッジリストの中には後から2つ目の三角形がついてInnerになったものもある
+            if (edge->type_ == BallPivotingEdge::Type::Border &&
+                visited.insert(edge).second) {
+                outgoing[edge->source_].push_back(edge);
+                ++n_incoming[edge->target_];
+            }
+        }
+        visited.clear();
+
+        std::vector<std::vector<BallPivotingVertexPtr>> loops;
+        for (const BallPivotingEdgePtr& start : border_edges_) {
+            if (start->type_ != BallPivotingEdge::Type::Border ||
+                visited.count(start) > 0) {
+                continue;
+            }
+            std::vector<BallPivotingVertexPtr> loop;
+            std::vector<BallPivotingEdgePtr> loop_edges;
+            BallPivotingEdgePtr edge = start;
+            bool closed = false;
+            while (visited.insert(edge).second) {
+                loop.push_back(edge->source_);
+                loop_edges.push_back(edge);
+                auto it = outgoing.find(edge->target_);
+                if (it == outgoing.end() || it->second.size() != 1 ||
+                    n_incoming[edge->target_] != 1) {
+                    break;
+                }
+                edge = it->second[0];
+                if (edge == start) {
+                    closed = true;
+                    break;
+                }
+            }
+            if (closed) {
+                loops.push_back(loop);
+            } else if (open_edges != nullptr) {
+                open_edges->insert(open_edges->end(), loop_edges.begin(),
+                                   loop_edges.end());
+            }
+        }
+        return loops;
+    }
+
+    //境界ループで囲まれた穴を，面積の合計が最小になる三角形分割で埋める(動的計画法，O(m^3))．
+    //ループの頂点間にすでにエッジがある場合，その対角線は使わない(3つ目の三角形がつくのを防ぐ)．
+    //そういう対角線しかなく埋められない場合はFalseを返す
+    bool FillHole(const std::vector<BallPivotingVertexPtr>& loop) {
+        const int m = static_cast<int>(loop.size());
+        const double inf = std::numeric_limits<double>::infinity();
+        std::vector<double> weight(m * m, 0.0);
+        std::vector<int> split(m * m, -1);
+        for (int gap = 2; gap < m; ++gap) {
+            for (int i = 0; i + gap < m; ++i) {
+                int j = i + gap;
+                weight[i * m + j] = inf;
+                //i = 0, j = m - 1はループの辺そのもの
+                if (!(i == 0 && j == m - 1) &&
+                    GetLinkingEdge(loop[i], loop[j]) != nullptr) {
+                    continue;
+                }
+                for (int k = i + 1; k < j; ++k) {
+                    double area = 0.5 * (loop[k]->point_ - loop[i]->point_)
+                                                .cross(loop[j]->point_ -
+                                                       loop[i]->point_)
+                                                .norm();
+                    double w = weight[i * m + k] + weight[k * m + j] + area;
+                    if (w < weight[i * m + j]) {
+                        weight[i * m + j] = w;
+                        split[i * m + j] = k;
+                    }
+                }
+            }
+        }
+        if (weight[m - 1] == inf) {
+            return false;
+        }
+
+        std::vector<std::pair<int, int>> stack = {{0, m - 1}};
+        while (!stack.empty()) {
+            int i = stack.back().first, j = stack.back().second;
+            stack.pop_back();
+            if (j - i < 2) {
+                continue;
+            }
+            int k = split[i * m + j];
+            const Eigen::Vector3d& a = loop[i]->point_;
+            const Eigen::Vector3d& b = loop[k]->point_;
+            const Eigen::Vector3d& c = loop[j]->point_;
+            //埋めた三角形には球がないので，外接円の中心を球の中心の代わりにする(高さ0の球)
+            Eigen::Vector3d ab = b - a, ac = c - a, n = ab.cross(ac);
+            double n2 = n.squaredNorm();
+            Eigen::Vector3d center = (a + b + c) / 3.0;
+            if (n2 > 0) {
+                center = a + (ac.squaredNorm() * n.cross(ab) +
+                              ab.squaredNorm() * ac.cross(n)) /
+                                     (2.0 * n2);
+            }
+            //ループはまわりの三角形の回り順でたどっているので，穴を埋める三角形は逆順にすると向きが揃う
+            CreateTriangle(loop[j], loop[k], loop[i], center, true);
+            stack.push_back({i, k});
+            stack.push_back({k, j});
+        }
+        return true;
+    }
+
+    //最後の半径の後に残ったBorderエッジのループのうち，max_hole_edges_本以下の小さな穴を埋める．
+    //エッジの構造をそのまま使うので，メッシュを出力してから隣接関係を作り直す必要がない
+    void FillHoles() {
+        std::vector<std::vector<BallPivotingVertexPtr>> loops =
+                CollectBorderLoops();
+        size_t n_filled = 0;
+        size_t n_triangles = NumTriangles();
+        for (const std::vector<BallPivotingVertexPtr>& loop : loops) {
+            if (loop.size() > static_cast<size_t>(option_.max_hole_edges_)) {
+                continue;
+            }
+            if (FillHole(loop)) {
+                ++n_filled;
+            }
+        }
+        //埋めた穴のエッジはInnerになったのでリストから外す
+        border_edges_.remove_if([](const BallPivotingEdgePtr& edge) {
+            return edge->type_ != BallPivotingEdge::Type::Border;
+        });
+        utility::LogDebug(
+                "[FillHoles] filled {:d} of {:d} holes with {:d} triangles",
+                n_filled, loops.size(), NumTriangles() - n_triangles);
+    }
+
+    //エッジが持っている隣接三角形(triangle0, triangle1)から半辺構造を作る．
+    //三角形tのk番目の半辺(頂点k -> 頂点k+1)をhalf_edges_[3t + k]に置くのでnextは計算で決まり，
+    //twinはエッジを1回ずつたどるだけで決まる(ソートや辺のハッシュは不要)
+    void ExportHalfEdges(const std::vector<int>& old_to_new,
+                         BallPivotingResult& result) {
+        auto index = [&old_to_new](const BallPivotingVertexPtr& v) {
+            return old_to_new.empty() ? v->idx_ : old_to_new[v->idx_];
+        };
+        const std::vector<Eigen::Vector3i>& triangles = mesh_->triangles_;
+        std::vector<HalfEdgeTriangleMesh::HalfEdge>& half_edges =
+                result.half_edges_;
+        half_edges.resize(3 * triangles.size());
+        for (int tidx = 0; tidx < static_cast<int>(triangles.size()); ++tidx) {
+            for (int k = 0; k < 3; ++k) {
+                half_edges[3 * tidx + k] = HalfEdgeTriangleMesh::HalfEdge(
+                        Eigen::Vector2i(triangles[tidx](k),
+                                        triangles[tidx]((k + 1) % 3)),
+                        tidx, 3 * tidx + (k + 1) % 3, -1);
+            }
+        }
+        //三角形の中で(u, v)の辺が何番目の半辺か
+        auto find_half_edge = [&](const BallPivotingTrianglePtr& triangle,
+                                  int u, int v) {
+            const Eigen::Vector3i& t = triangles[triangle->index_];
+            for (int k = 0; k < 3; ++k) {
+                int a = t(k), b = t((k + 1) % 3);
+                if ((a == u && b == v) || (a == v && b == u)) {
+                    return 3 * triangle->index_ + k;
+                }
+            }
+            return -1;
+        };
+        size_t n_inconsistent = 0;
+        for (const BallPivotingVertexPtr& vertex : vertices) {
+            for (const BallPivotingEdgePtr& edge : vertex->edges_) {
+                //各エッジはsourceの頂点から見たときだけ処理する
+                if (edge->source_ != vertex || edge->triangle1_ == nullptr) {
+                    continue;
+                }
+                int u = index(edge->source_), v = index(edge->target_);
+                int h0 = find_half_edge(edge->triangle0_, u, v);
+                int h1 = find_half_edge(edge->triangle1_, u, v);
+                if (h0 < 0 || h1 < 0) {
+                    continue;
+                }
+                //2つの三角形の出力の向きが逆になっている場合は同じ向きの半辺になるので，twinにはしない
+                if (half_edges[h0].vertex_indices_(0) !=
+                    half_edges[h1].vertex_indices_(1)) {
+                    ++n_inconsistent;
+                    continue;
+                }
+                half_edges[h0].twin_ = h1;
+                half_edges[h1].twin_ = h0;
+            }
+        }
+        utility::LogDebug(
+                "[ExportHalfEdges] {:d} half edges, {:d} edges with "
+                "inconsistently oriented triangles",
+                half_edges.size(), n_inconsistent);
+    }
+
+    //compact_output_の場合に，三角形が参照している頂点だけを残したメッシュにする．
+    //三角形に使われた頂点はエッジを持つのでタイプがOrphanではない．なのでフラグを立てるパスは不要で，
+    //インデックスの振り直しだけ逐次で行い，頂点・法線・色のコピーと三角形の付け替えは並列に行う．
+    //vertex_indicesには新しい頂点ごとに元の点群でのインデックスが入る
+    //戻り値は元のインデックスから新しいインデックスへの対応表(使われていない頂点は-1)
+    std::vector<int> CompactMesh(std::vector<int>& vertex_indices) {
+        const int n = static_cast<int>(vertices.size());
+        std::vector<int> old_to_new(n, -1);
+        vertex_indices.clear();
+        for (int vidx = 0; vidx < n; ++vidx) {
+            if (vertices[vidx]->type_ != BallPivotingVertex::Type::Orphan) {
+                old_to_new[vidx] = static_cast<int>(vertex_indices.size());
+                vertex_indices.push_back(vidx);
+            }
+        }
+        const int n_compact = static_cast<int>(vertex_indices.size());
+        utility::LogDebug("[CompactMesh] keeps {:d} of {:d} vertices",
+                          n_compact, n);
+
+        std::vector<Eigen::Vector3d> compact_vertices(n_compact);
+        std::vector<Eigen::Vector3d> compact_normals(
+                kVertexNormals ? n_compact : 0);
+        std::vector<Eigen::Vector3d> compact_colors(
+                kVertexColors ? n_compact : 0);
+#pragma omp parallel for schedule(static) \
+        num_threads(utility::EstimateMaxThreads())
+        for (int i = 0; i < n_compact; ++i) {
+            int vidx = vertex_indices[i];
+            compact_vertices[i] = mesh_->vertices_[vidx];
+            if constexpr (kVertexNormals) {
+                compact_normals[i] = mesh_->vertex_normals_[vidx];
+            }
+            if constexpr (kVertexColors) {
+                compact_colors[i] = mesh_->vertex_colors_[vidx];
+            }
+        }
+        const int n_triangles = static_cast<int>(mesh_->triangles_.size());
+#pragma omp parallel for schedule(static) \
+        num_threads(utility::EstimateMaxThreads())
+        for (int tidx = 0; tidx < n_triangles; ++tidx) {
+            Eigen::Vector3i& triangle = mesh_->triangles_[tidx];
+            triangle = Eigen::Vector3i(old_to_new[triangle(0)],
+                                       old_to_new[triangle(1)],
+                                       old_to_new[triangle(2)]);
+        }
+        mesh_->vertices_.swap(compact_vertices);
+        mesh_->vertex_normals_.swap(compact_normals);
+        mesh_->vertex_colors_.swap(compact_colors);
+        return old_to_new;
+    }
+
+    //残った境界をresultに書き出す．ループはBorderエッジのリストから作るのでメッシュを走査し直す必要はなく，
+    //非多様体のエッジはAddAdjacentTriangleで起きた時点で記録してある．
+    //old_to_newが空でなければ(compact_output_)インデックスを付け替える
+    void ExportBoundaries(const std::vector<int>& old_to_new,
+                          BallPivotingResult& result) {
+        auto index = [&old_to_new](const BallPivotingVertexPtr& v) {
+            return old_to_new.empty() ? v->idx_ : old_to_new[v->idx_];
+        };
+        std::vector<BallPivotingEdgePtr> open_edges;
+        std::vector<std::vector<BallPivotingVertexPtr>> loops =
+                CollectBorderLoops(&open_edges);
+        result.boundary_loops_.clear();
+        for (const std::vector<BallPivotingVertexPtr>& loop : loops) {
+            std::vector<int> indices;
+            indices.reserve(loop.size());
+            for (const BallPivotingVertexPtr& v : loop) {
+                indices.push_back(index(v));
+            }
+            result.boundary_loops_.push_back(indices);
+        }
+        result.open_boundary_edges_.clear();
+        for (const BallPivotingEdgePtr& edge : open_edges) {
+            result.open_boundary_edges_.emplace_back(index(edge->source_),
+                                                     index(edge->target_));
+        }
+        result.non_manifold_edges_.clear();
+        for (const Eigen::Vector2i& edge : non_manifold_edges_) {
+            result.non_manifold_edges_.emplace_back(
+                    index(vertices[edge(0)]), index(vertices[edge(1)]));
+        }
+        utility::LogDebug(
+                "[ExportBoundaries] {:d} loops, {:d} open border edges, {:d} "
+                "non-manifold edges",
+                result.boundary_loops_.size(),
+                result.open_boundary_edges_.size(),
+                result.non_manifold_edges_.size());
+    }
+
+    //ストリーミング用：前の窓で確定した三角形のうち，まだ確定していない部分に接するものをRunの前に登録する(回り順はそのまま)．
+    //retiredより前の頂点はfrontier(確定していない三角形が使っていた頂点)以外Innerにしてもう使わない．
+    //三角形が1つだけの辺は，両端がまだ使える頂点の場合だけ次の半径で回転を試す
+    void AddFixedTriangles(const std::vector<Eigen::Vector3i>& triangles,
+                           const std::vector<int>& frontier,
+                           int retired,
+                           const std::vector<double>& radii) {
+        has_fixed_triangles_ = true;
+        std::vector<bool> active(vertices.size(), true);
+        std::fill(active.begin(), active.begin() + retired, false);
+        for (int vidx : frontier) {
+            active[vidx] = true;
+        }
+        for (const Eigen::Vector3i& t : triangles) {
+            //その三角形を作れた一番小さい半径で球の中心を求め直す
+            Eigen::Vector3d center = (vertices[t(0)]->point_ +
+                                      vertices[t(1)]->point_ +
+                                      vertices[t(2)]->point_) /
+                                     3.0;
+            for (double radius : radii) {
+                if (ComputeBallCenter(t(0), t(1), t(2), radius, center)) {
+                    break;
+                }
+            }
+            CreateTriangle(vertices[t(0)], vertices[t(1)], vertices[t(2)],
+                           center, true);
+        }
+        for (const Eigen::Vector3i& t : triangles) {
+            for (int k = 0; k < 3; ++k) {
+                BallPivotingEdgePtr edge = GetLinkingEdge(
+                        vertices[t(k)], vertices[t((k + 1) % 3)]);
+                //解放された辺(nullptr)はInnerだった
+                if (edge != nullptr &&
+                    edge->type_ == BallPivotingEdge::Type::Front) {
+                    edge->type_ = BallPivotingEdge::Type::Border;
+                    if (active[edge->source_->idx_] &&
+                        active[edge->target_->idx_]) {
+                        border_edges_.push_back(edge);
+                    }
+                }
+            }
+        }
+        for (int vidx = 0; vidx < retired; ++vidx) {
+            if (!active[vidx]) {
+                vertices[vidx]->type_ = BallPivotingVertex::Type::Inner;
+            }
+        }
+    }
+
+    //各構造が使っているメモリを要素数と容量から見積もって記録する．
+    //shared_ptrで確保した辺と三角形には制御ブロックの分(ポインタ2つ分)を，
+    //リストのノードにはポインタ2つ分を足す．KDTreeは点の座標のコピーとインデックスで1点あたり点1つ分+int2つ
+    void SampleMemoryUsage(const std::string& phase,
+                           BallPivotingResult* result) {
+        if (!option_.output_memory_usage_) {
+            return;
+        }
+        const size_t node = 2 * sizeof(void*);
+        BallPivotingMemoryUsage usage;
+        usage.phase_ = phase;
+        usage.resource_bytes_ = upstream_.Live();
+        usage.resource_peak_bytes_ = upstream_.Peak();
+        //以下は構造ごとの内訳の見積もり(arena_が解放せずに持っている分は入らない)
+        usage.vertex_bytes_ =
+                vertex_storage_.capacity() * sizeof(BallPivotingVertex) +
+                vertices.capacity() * sizeof(BallPivotingVertexPtr);
+        for (const BallPivotingVertex& vertex : vertex_storage_) {
+            usage.vertex_bytes_ +=
+                    vertex.edges_.capacity() * sizeof(BallPivotingEdgePtr);
+        }
+        usage.edge_bytes_ = n_edges_ * (sizeof(BallPivotingEdge) + node);
+        usage.triangle_bytes_ =
+                n_triangles_ * (sizeof(BallPivotingTriangle) + node);
+        usage.queue_bytes_ =
+                edge_front_.Bytes(node) +
+                border_edges_.size() * (node + sizeof(BallPivotingEdgePtr));
+        if (option_.organized_width_ <= 0) {
+            usage.index_bytes_ = vertices.size() * (sizeof(Eigen::Vector3d) +
+                                                    2 * sizeof(int));
+        }
+        usage.index_bytes_ +=
+                scratch_.indices.capacity() * sizeof(int) +
+                scratch_.dists2.capacity() * sizeof(double) +
+                scratch_.compatible.capacity() * sizeof(int) +
+                (scratch_.ordered.capacity() + scratch_.found.capacity()) *
+                        sizeof(std::pair<double, int>);
+        usage.mesh_bytes_ =
+                mesh_->vertices_.capacity() * sizeof(Eigen::Vector3d) +
+                mesh_->vertex_normals_.capacity() * sizeof(Eigen::Vector3d) +
+                mesh_->vertex_colors_.capacity() * sizeof(Eigen::Vector3d) +
+                mesh_->triangles_.capacity() * sizeof(Eigen::Vector3i) +
+                mesh_->triangle_normals_.capacity() * sizeof(Eigen::Vector3d);
+        utility::LogDebug(
+                "[Memory] {}: resource={:d} (peak {:d}), index={:d}, "
+                "mesh={:d}, total={:d} bytes",
+                phase, usage.resource_bytes_, usage.resource_peak_bytes_,
+                usage.index_bytes_, usage.mesh_bytes_, usage.Total());
+        utility::LogDebug(
+                "[Memory] {}: estimated vertices={:d}, edges={:d}, "
+                "triangles={:d}, queues={:d} bytes",
+                phase, usage.vertex_bytes_, usage.edge_bytes_,
+                usage.triangle_bytes_, usage.queue_bytes_);
+        if (result == nullptr) {
+            return;
+        }
+        BallPivotingMemoryUsage& peak = result->peak_memory_usage_;
+        //peakは項目ごとの最大値なので，そのTotal()はどのサンプルの合計とも一致しない．
+        //phase_は合計が最大のサンプルを別に覚えて決める
+        if (peak.phase_.empty() || usage.Total() > peak_sample_total_) {
+            peak_sample_total_ = usage.Total();
+            peak.phase_ = phase;
+        }
+        peak.resource_bytes_ =
+                std::max(peak.resource_bytes_, usage.resource_bytes_);
+        peak.resource_peak_bytes_ = std::max(peak.resource_peak_bytes_,
+                                             usage.resource_peak_bytes_);
+        peak.vertex_bytes_ = std::max(peak.vertex_bytes_, usage.vertex_bytes_);
+        peak.edge_bytes_ = std::max(peak.edge_bytes_, usage.edge_bytes_);
+        peak.triangle_bytes_ =
+                std::max(peak.triangle_bytes_, usage.triangle_bytes_);
+        peak.queue_bytes_ = std::max(peak.queue_bytes_, usage.queue_bytes_);
+        peak.index_bytes_ = std::max(peak.index_bytes_, usage.index_bytes_);
+        peak.mesh_bytes_ = std::max(peak.mesh_bytes_, usage.mesh_bytes_);
+        result->memory_usage_.push_back(usage);
+    }
+
+    std::shared_ptr<TriangleMesh> Run(const std::vector<double>& radii,
+                                      BallPivotingResult* result = nullptr) {
         if (!has_normals_) {
             utility::LogError("ReconstructBallPivoting requires normals");
         }
-
-        mesh_->triangles_.clear();//メッシュをクリア
+        if (result != nullptr) {
+            result->memory_usage_.clear();
+            result->peak_memory_usage_ = BallPivotingMemoryUsage();
+        }
+        peak_sample_total_ = 0;
+        SampleMemoryUsage("start", result);
+        if (option_.organized_width_ > 0) {
+            window_ = option_.organized_window_ > 0
+                              ? option_.organized_window_
+                              : EstimateOrganizedWindow(radii);
+        }
 
         //与えられた半径を順番に使ってメッシュを生成する
         for (double radius : radii) {
@@ -782,6 +2320,16 @@ public:
                 utility::LogError(
                         "got an invalid, negative radius as parameter");
             }
+            //Frontはこの時点で空なので，セルの大きさを半径に合わせて変えられる
+            edge_front_.SetCellSize(16.0 * radius);
+
+            //近傍点の数は半径で変わるので，外れ値の判定は半径ごとにやり直す
+            if (option_.outlier_ratio_ > 0) {
+                for (BallPivotingVertexPtr vertex : vertices) {
+                    vertex->outlier_ = false;
+                }
+                EstimateNeighborCount(radius);
+            }
 
             // update radius => update border edges
             //最初の半径はこのfor文の工程は行わない．ここは最初の半径の球で作成した面を次の半径の球で生成した面に更新するためにある
@@ -798,13 +2346,12 @@ public:
                         triangle->vert2_->idx_);
 
                 Eigen::Vector3d center;
-                if (ComputeBallCenter(triangle->vert0_->idx_,
-                                      triangle->vert1_->idx_,
-                                      triangle->vert2_->idx_, radius, center)) {
+                if (ComputeBallCenter(triangle, radius, center)) {
                     utility::LogDebug("[Run]   yes, we can work on this");
-                    std::vector<int> indices;
-                    std::vector<double> dists2;
-                    kdtree_.SearchRadius(center, radius, indices, dists2);
+                    std::vector<int>& indices = scratch_.indices;
+                    std::vector<double>& dists2 = scratch_.dists2;
+                    SearchNeighbors(center, triangle->vert0_->idx_, radius,
+                                    indices, dists2);
                     bool empty_ball = true;
                     for (auto idx : indices) {
                         if (idx != triangle->vert0_->idx_ &&
@@ -839,28 +2386,652 @@ public:
             } else {
                 //三角形を拡張していく
                 ExpandTriangulation(radius);
+                //引き継いだ三角形がある場合は，それにつながらない新しい点からもシードを探す
+                if (has_fixed_triangles_ && radius == radii.front()) {
+                    FindSeedTriangle(radius);
+                }
             }
 
-            utility::LogDebug("[Run] mesh_ has {:d} triangles",
-                              mesh_->triangles_.size());
+            utility::LogDebug(
+                    "[Run] mesh_ has {:d} triangles, {:d} border edges",
+                    NumTriangles(), border_edges_.size());
             utility::LogDebug("[Run] ################################");
+            SampleMemoryUsage(fmt::format("radius {:.4f}", radius), result);
+        }
+        utility::LogDebug(
+                "[Run] candidates: searched={:d}, edge vertices={:d}, "
+                "outliers={:d}, outside torus={:d}, incompatible normals={:d}, "
+                "intersecting={:d}, "
+                "no ball center={:d}, larger angle={:d}, non-empty ball={:d}",
+                candidate_counts_.searched, candidate_counts_.edge_vertices,
+                candidate_counts_.outliers, candidate_counts_.outside_torus,
+                candidate_counts_.incompatible,
+                candidate_counts_.intersecting, candidate_counts_.no_ball,
+                candidate_counts_.larger_angle,
+                candidate_counts_.non_empty_ball);
+        //回転角の下限の順に並べたことで，空の球の判定まで行かずに済んだ候補点の割合
+        size_t avoided =
+                candidate_counts_.larger_angle + candidate_counts_.ordered_out;
+        utility::LogDebug(
+                "[Run] empty-ball tests={:d}, skipped by angle order={:d}, "
+                "avoided={:.1f}%",
+                candidate_counts_.empty_ball_tests,
+                candidate_counts_.ordered_out,
+                100.0 * avoided /
+                        std::max<size_t>(
+                                avoided + candidate_counts_.empty_ball_tests,
+                                1));
+        if (option_.outlier_ratio_ > 0) {
+            utility::LogDebug("[Run] outliers: seeds skipped={:d}",
+                              n_outliers_);
+        }
+        utility::LogDebug(
+                "[Run] front: expanded edges={:d}, mean jump between "
+                "consecutive edges={:.6f}",
+                front_counts_.pops,
+                front_counts_.jump /
+                        std::max<size_t>(front_counts_.pops - 1, 1));
+        //取り出した時点でFrontではなかった辺の割合(Compactで先に取り除いた辺は含まない)
+        utility::LogDebug(
+                "[Run] front: stale pops={:d} ({:.1f}%), compacted={:d}",
+                front_counts_.stale,
+                100.0 * front_counts_.stale /
+                        std::max<size_t>(
+                                front_counts_.pops + front_counts_.stale, 1),
+                edge_front_.NumCompacted());
+
+        if (option_.max_hole_edges_ >= 3) {
+            FillHoles();
+            SampleMemoryUsage("fill holes", result);
+        }
+        if (!option_.spill_path_.empty()) {
+            FinishSpill();
+        }
+
+        std::vector<int> old_to_new;
+        if (option_.compact_output_) {
+            std::vector<int> vertex_indices;
+            old_to_new = CompactMesh(vertex_indices);
+            if (result != nullptr) {
+                result->vertex_indices_.swap(vertex_indices);
+            }
         }
+        if (option_.output_boundaries_ && result != nullptr) {
+            ExportBoundaries(old_to_new, *result);
+        }
+        if (option_.output_half_edges_ && result != nullptr) {
+            ExportHalfEdges(old_to_new, *result);
+        }
+        SampleMemoryUsage("end", result);
         return mesh_;
     }
 
 private:
+    //頂点，辺，三角形，リストなどの内部状態はすべてresource_から確保する．
+    //option_.memory_resource_がなければarena_を使い，BallPivotingを破棄したときにまとめて解放する．
+    //release_interior_の場合は解放した分を再利用できるpool_を使う
+    //(以下のメンバより先に作られ，後に破棄される)．
+    //upstream_はarena_とpool_の上流(option_.memory_resource_があればそれ自体)で，
+    //実際に確保しているバイト数をSampleMemoryUsageに報告する
+    BallPivotingCountingResource upstream_;
+    std::pmr::monotonic_buffer_resource arena_{&upstream_};
+    std::pmr::unsynchronized_pool_resource pool_{&upstream_};
+    std::pmr::memory_resource* resource_;
     bool has_normals_;
+    //AddFixedTrianglesで三角形を引き継いだか
+    bool has_fixed_triangles_ = false;
+    //spill_path_に書き出したファイル，三角形の数と符号化用のバッファ
+    std::ofstream spill_file_;
+    size_t n_spilled_ = 0;
+    std::vector<uint8_t> spill_bytes_;
+    //確保した辺と三角形の数(SampleMemoryUsage用)
+    size_t n_edges_ = 0;
+    size_t n_triangles_ = 0;
     KDTreeFlann kdtree_;//最近傍探索などに使用される
-    std::list<BallPivotingEdgePtr> edge_front_;//未処理のエッジリスト
-    std::list<BallPivotingEdgePtr> border_edges_;//処理済みの境界エッジ
-    std::vector<BallPivotingVertexPtr> vertices;
+    BallPivotingOption option_;
+    //3つ目の三角形を追加しようとしたエッジ(source, targetの頂点インデックス)
+    std::vector<Eigen::Vector2i> non_manifold_edges_;
+    //memory_usage_の中で合計が最大のサンプルの合計(peak_memory_usage_.phase_を決める)
+    size_t peak_sample_total_ = 0;
+    //画素の窓の半分の大きさ(Runで決める)と，窓が小さいと警告したか
+    int window_ = 0;
+    bool warned_window_ = false;
+    //ClassifyOutlierで使う近傍点の数の基準値と，外れ値と判定した数(全半径の合計)
+    double reference_neighbor_count_ = 0.0;
+    size_t n_outliers_ = 0;
+    BallPivotingFront edge_front_{option_.front_order_, resource_};//未処理のエッジ
+    std::pmr::list<BallPivotingEdgePtr> border_edges_{resource_};//処理済みの境界エッジ
+    std::pmr::vector<BallPivotingVertex> vertex_storage_{resource_};
+    std::pmr::vector<BallPivotingVertexPtr> vertices{resource_};
     std::shared_ptr<TriangleMesh> mesh_;
+    //近傍探索の結果などの作業用の配列．呼び出しごとに作り直さず使い回して，
+    //容量が足りてからはヒープ確保しないようにする(TrySeed, FindCandidateVertex, Runの境界の処理は入れ子にならない)
+    //画素の並びを持つ点群(organized_width_)ではこれで回転中のヒープ確保がなくなる．
+    //KDTreeを使う場合はKDTreeFlann::SearchRadiusが内部で作る配列の確保が1回の探索ごとに残る
+    struct Scratch {
+        std::vector<int> indices;
+        std::vector<double> dists2;
+        std::vector<int> compatible;
+        std::vector<std::pair<double, int>> ordered;
+        std::vector<std::pair<double, int>> found;  //SearchNeighbors(画素の窓)
+    } scratch_;
+    //FindCandidateVertexで候補点が各段階で除外された数
+    struct CandidateCounts {
+        size_t searched = 0;        //SearchRadiusで見つかった点
+        size_t edge_vertices = 0;   //辺の三角形の頂点
+        size_t outliers = 0;        //外れ値と判定済みの点
+        size_t outside_torus = 0;   //球が触れられない(トーラスの外の)点
+        size_t incompatible = 0;    //法線の向きが合わない
+        size_t intersecting = 0;    //既存の三角形と交差する
+        size_t no_ball = 0;         //球の中心を計算できない
+        size_t larger_angle = 0;    //角度がmin_angle以上
+        size_t non_empty_ball = 0;  //球の中に他の点がある
+        size_t empty_ball_tests = 0;  //空の球の判定をした回数
+        size_t ordered_out = 0;       //回転角の下限がmin_angle以上で調べなかった
+    } candidate_counts_;
+    //ExpandTriangulationで取り出したFrontエッジの数と読み飛ばした辺の数，続く辺の中点の間の距離の合計
+    struct FrontCounts {
+        size_t pops = 0;
+        size_t stale = 0;
+        double jump = 0.0;
+        Eigen::Vector3d last = Eigen::Vector3d::Zero();
+    } front_counts_;
 };
 
+//距離epsilon以内の点を1点にまとめた点群を返す．unique_to_inputには残した点の入力でのインデックスが入る．
+//一辺epsilonのハッシュグリッドで周りの27セルだけを調べ，各点についてepsilon以内で一番小さいインデックスの点を
+//並列に探す．その後インデックスの小さい順にたどって代表点を確定させる(鎖状につながった点も1つにまとまる)．
+//epsilon = 0の場合は全く同じ座標の点だけがまとまる．代表点の座標・法線・色はそのまま使う(色はwith_colorsの場合だけ)
+static std::shared_ptr<PointCloud> CollapseDuplicatePoints(
+        const PointCloud& pcd,
+        double epsilon,
+        bool with_colors,
+        std::vector<int>& unique_to_input) {
+    typedef Eigen::Matrix<int64_t, 3, 1> Cell;
+    const int n = static_cast<int>(pcd.points_.size());
+    //セルは有限な点のバウンディングボックスの最小点から数える(原点から遠い点群でも
+    //セルの番号が小さく保たれる)．NaNなどの点はグリッドに入れず，まとめない
+    Eigen::Vector3d min_bound = Eigen::Vector3d::Constant(DBL_MAX);
+    Eigen::Vector3d max_bound = Eigen::Vector3d::Constant(-DBL_MAX);
+    for (const Eigen::Vector3d& point : pcd.points_) {
+        if (point.allFinite()) {
+            min_bound = min_bound.cwiseMin(point);
+            max_bound = max_bound.cwiseMax(point);
+        }
+    }
+    if (!(min_bound(0) <= max_bound(0))) {
+        min_bound = max_bound = Eigen::Vector3d::Zero();
+    }
+    double cell_size = epsilon;
+    if (cell_size <= 0.0) {
+        cell_size = std::max((max_bound - min_bound).norm() * 1e-6, 1e-300);
+    }
+    //点の範囲に対してepsilonが小さすぎる場合もint64に収まるように，セルの数を1軸2^40までにする
+    cell_size = std::max(cell_size,
+                         (max_bound - min_bound).maxCoeff() / double(1LL << 40));
+    auto cell_of = [cell_size, &min_bound](const Eigen::Vector3d& point) {
+        return Cell(((point - min_bound) / cell_size)
+                            .array()
+                            .floor()
+                            .cast<int64_t>());
+    };
+
+    std::unordered_map<Cell, std::vector<int>, utility::hash_eigen<Cell>> grid;
+    for (int i = 0; i < n; ++i) {
+        if (pcd.points_[i].allFinite()) {
+            grid[cell_of(pcd.points_[i])].push_back(i);
+        }
+    }
+
+    const double epsilon2 = epsilon * epsilon;
+    //全く同じ座標の点は必ず同じセルに入るので，epsilon = 0なら自分のセルだけ調べればよい
+    const int reach = epsilon > 0.0 ? 1 : 0;
+    std::vector<int> representative(n);
+#pragma omp parallel for schedule(static) \
+        num_threads(utility::EstimateMaxThreads())
+    for (int i = 0; i < n; ++i) {
+        const Eigen::Vector3d& point = pcd.points_[i];
+        int first = i;
+        if (!point.allFinite()) {
+            representative[i] = first;
+            continue;
+        }
+        Cell cell = cell_of(point);
+        for (int dx = -reach; dx <= reach; ++dx) {
+            for (int dy = -reach; dy <= reach; ++dy) {
+                for (int dz = -reach; dz <= reach; ++dz) {
+                    auto it = grid.find(cell + Cell(dx, dy, dz));
+                    if (it == grid.end()) {
+                        continue;
+                    }
+                    //セル内のインデックスは昇順なのでiより大きくなったら終わり
+                    for (int j : it->second) {
+                        if (j >= first) {
+                            break;
+                        }
+                        if ((pcd.points_[j] - point).squaredNorm() <=
+                            epsilon2) {
+                            first = j;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+        representative[i] = first;
+    }
+
+    auto unique_pcd = std::make_shared<PointCloud>();
+    unique_to_input.clear();
+    for (int i = 0; i < n; ++i) {
+        //representative[i] <= iなので代表点の代表点はもう確定している
+        int root = representative[representative[i]];
+        representative[i] = root;
+        if (root == i) {
+            unique_to_input.push_back(i);
+            unique_pcd->points_.push_back(pcd.points_[i]);
+            if (pcd.HasNormals()) {
+                unique_pcd->normals_.push_back(pcd.normals_[i]);
+            }
+            if (with_colors && pcd.HasColors()) {
+                unique_pcd->colors_.push_back(pcd.colors_[i]);
+            }
+        }
+    }
+    return unique_pcd;
+}
+
+template <bool kTriangleNormals, bool kVertexNormals, bool kVertexColors>
+static std::shared_ptr<TriangleMesh> RunBallPivoting(
+        const PointCloud& pcd,
+        const std::vector<double>& radii,
+        const BallPivotingOption& option,
+        BallPivotingResult* result) {
+    BallPivoting<kTriangleNormals, kVertexNormals, kVertexColors> bp(pcd,
+                                                                      option);
+    return bp.Run(radii, result);
+}
+
+//出力する属性に合わせたBallPivotingの特殊化を選んで実行する．
+//vertex_attributesがfalseの場合は頂点の法線と色を出力しない(呼び出し側で付け直す場合)
+static std::shared_ptr<TriangleMesh> DispatchBallPivoting(
+        const PointCloud& pcd,
+        const std::vector<double>& radii,
+        const BallPivotingOption& option,
+        bool vertex_attributes,
+        BallPivotingResult* result) {
+    const bool triangle_normals = option.output_triangle_normals_;
+    const bool vertex_normals =
+            vertex_attributes && option.output_vertex_normals_;
+    const bool vertex_colors = vertex_attributes &&
+                               option.output_vertex_colors_ && pcd.HasColors();
+    switch ((triangle_normals ? 4 : 0) | (vertex_normals ? 2 : 0) |
+            (vertex_colors ? 1 : 0)) {
+        case 0:
+            return RunBallPivoting<false, false, false>(pcd, radii, option,
+                                                        result);
+        case 1:
+            return RunBallPivoting<false, false, true>(pcd, radii, option,
+                                                       result);
+        case 2:
+            return RunBallPivoting<false, true, false>(pcd, radii, option,
+                                                       result);
+        case 3:
+            return RunBallPivoting<false, true, true>(pcd, radii, option,
+                                                      result);
+        case 4:
+            return RunBallPivoting<true, false, false>(pcd, radii, option,
+                                                       result);
+        case 5:
+            return RunBallPivoting<true, false, true>(pcd, radii, option,
+                                                      result);
+        case 6:
+            return RunBallPivoting<true, true, false>(pcd, radii, option,
+                                                      result);
+        default:
+            return RunBallPivoting<true, true, true>(pcd, radii, option,
+                                                     result);
+    }
+}
+
+std::shared_ptr<TriangleMesh> ReconstructBallPivoting(
+        const PointCloud& pcd,
+        const std::vector<double>& radii,
+        const BallPivotingOption& option,
+        BallPivotingResult* result) {
+    //画素の並びを持つ点群では点をまとめると画素の格子が崩れるので，まとめない
+    if (option.collapse_duplicates_ && option.organized_width_ > 0) {
+        utility::LogWarning(
+                "[ReconstructBallPivoting] collapse_duplicates_ is ignored "
+                "for organized point clouds");
+    }
+    if (!option.collapse_duplicates_ || option.organized_width_ > 0 ||
+        !pcd.HasPoints()) {
+        return DispatchBallPivoting(pcd, radii, option, true, result);
+    }
+
+    utility::Timer timer;
+    timer.Start();
+    std::vector<int> unique_to_input;
+    //compact_output_でない場合，頂点の属性は最後に入力点群から付け直すので代表点の分は要らない
+    const bool vertex_attributes = option.compact_output_;
+    std::shared_ptr<PointCloud> unique_pcd = CollapseDuplicatePoints(
+            pcd, option.duplicate_epsilon_,
+            vertex_attributes && option.output_vertex_colors_,
+            unique_to_input);
+    timer.Stop();
+    utility::LogDebug(
+            "[ReconstructBallPivoting] collapsed {:d} points to {:d} in "
+            "{:.2f} ms",
+            pcd.points_.size(), unique_pcd->points_.size(),
+            timer.GetDurationInMillisecond());
+
+    std::shared_ptr<TriangleMesh> mesh = DispatchBallPivoting(
+            *unique_pcd, radii, option, vertex_attributes, result);
+
+    //compact_output_の場合はメッシュは既に使われた代表点だけなので，対応表だけ入力点群のインデックスに戻す
+    if (option.compact_output_) {
+        if (result != nullptr) {
+            for (int& vidx : result->vertex_indices_) {
+                vidx = unique_to_input[vidx];
+            }
+        }
+        return mesh;
+    }
+
+    //三角形のインデックスを入力点群のインデックスに戻し，頂点も入力点群のものにする
+    for (Eigen::Vector3i& triangle : mesh->triangles_) {
+        for (int k = 0; k < 3; ++k) {
+            triangle(k) = unique_to_input[triangle(k)];
+        }
+    }
+    if (option.output_boundaries_ && result != nullptr) {
+        for (std::vector<int>& loop : result->boundary_loops_) {
+            for (int& vidx : loop) {
+                vidx = unique_to_input[vidx];
+            }
+        }
+        for (Eigen::Vector2i& edge : result->open_boundary_edges_) {
+            edge = Eigen::Vector2i(unique_to_input[edge(0)],
+                                   unique_to_input[edge(1)]);
+        }
+        for (Eigen::Vector2i& edge : result->non_manifold_edges_) {
+            edge = Eigen::Vector2i(unique_to_input[edge(0)],
+                                   unique_to_input[edge(1)]);
+        }
+    }
+    if (option.output_half_edges_ && result != nullptr) {
+        for (HalfEdgeTriangleMesh::HalfEdge& half_edge :
+             result->half_edges_) {
+            Eigen::Vector2i& edge = half_edge.vertex_indices_;
+            edge = Eigen::Vector2i(unique_to_input[edge(0)],
+                                   unique_to_input[edge(1)]);
+        }
+    }
+    mesh->vertices_ = pcd.points_;
+    if (option.output_vertex_normals_) {
+        mesh->vertex_normals_ = pcd.normals_;
+    }
+    if (option.output_vertex_colors_) {
+        mesh->vertex_colors_ = pcd.colors_;
+    }
+    return mesh;
+}
+
+bool ReadBallPivotingSpill(
+        const std::string& path,
+        const std::vector<Eigen::Vector3d>& vertices,
+        const std::function<void(const std::vector<Eigen::Vector3i>&,
+                                 const std::vector<Eigen::Vector3d>&)>&
+                callback) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        utility::LogWarning("Cannot open spill file {}", path);
+        return false;
+    }
+    //ファイルは信用しない(途中で切れたファイルや別の実行のファイル，頂点の数が合わない場合は
+    //範囲外を読まずにFalseを返す)
+    const uint64_t file_size = static_cast<uint64_t>(file.tellg());
+    file.seekg(0);
+    const int64_t n_vertices = static_cast<int64_t>(vertices.size());
+    std::vector<uint8_t> bytes;
+    std::vector<Eigen::Vector3i> triangles;
+    std::vector<Eigen::Vector3d> normals;
+    uint64_t offset = 0;
+    uint32_t n_triangles;
+    while (file.read(reinterpret_cast<char*>(&n_triangles),
+                     sizeof(n_triangles))) {
+        uint8_t normals_flag;
+        uint32_t n_bytes;
+        if (!file.read(reinterpret_cast<char*>(&normals_flag),
+                       sizeof(normals_flag)) ||
+            !file.read(reinterpret_cast<char*>(&n_bytes), sizeof(n_bytes))) {
+            utility::LogWarning("Truncated spill file {}", path);
+            return false;
+        }
+        offset += sizeof(n_triangles) + sizeof(normals_flag) + sizeof(n_bytes);
+        //1つの三角形は少なくとも3バイトになる
+        if (normals_flag > 1 || n_bytes > file_size - offset ||
+            static_cast<uint64_t>(n_triangles) * 3 > n_bytes) {
+            utility::LogWarning("Corrupt spill file {}", path);
+            return false;
+        }
+        offset += n_bytes;
+        bytes.resize(n_bytes);
+        if (!file.read(reinterpret_cast<char*>(bytes.data()), n_bytes)) {
+            utility::LogWarning("Truncated spill file {}", path);
+            return false;
+        }
+        const uint8_t* p = bytes.data();
+        const uint8_t* end = p + bytes.size();
+        triangles.resize(n_triangles);
+        normals.clear();
+        int64_t prev = 0;
+        for (uint32_t tidx = 0; tidx < n_triangles; ++tidx) {
+            Eigen::Vector3i& t = triangles[tidx];
+            bool flipped = false;
+            for (int k = 0; k < 3; ++k) {
+                uint64_t code;
+                if (!spill::GetVarint(p, end, code)) {
+                    utility::LogWarning("Corrupt spill file {}", path);
+                    return false;
+                }
+                if (k == 0 && normals_flag) {
+                    flipped = (code & 1) != 0;
+                    code >>= 1;
+                }
+                //prevは[0, n_vertices)にあるので，差分で比べればオーバーフローしない
+                const int64_t delta = spill::UnZigZag(code);
+                if (delta < -prev || delta >= n_vertices - prev) {
+                    utility::LogWarning(
+                            "Spill file {} references a vertex outside of "
+                            "the {:d} vertices",
+                            path, n_vertices);
+                    return false;
+                }
+                prev += delta;
+                t(k) = static_cast<int>(prev);
+            }
+            if (normals_flag) {
+                //逆の回り順で出力した三角形は，CreateTriangleと同じ順(0, 2, 1)で計算する
+                normals.push_back(flipped ? spill::FaceNormal(vertices[t(0)],
+                                                              vertices[t(2)],
+                                                              vertices[t(1)])
+                                          : spill::FaceNormal(vertices[t(0)],
+                                                              vertices[t(1)],
+                                                              vertices[t(2)]));
+            }
+        }
+        if (p != end) {
+            utility::LogWarning("Corrupt spill file {}", path);
+            return false;
+        }
+        callback(triangles, normals);
+    }
+    //ブロックの頭の途中で切れた場合
+    if (file.gcount() != 0) {
+        utility::LogWarning("Truncated spill file {}", path);
+        return false;
+    }
+    return true;
+}
+
+BallPivotingStream::BallPivotingStream(const std::vector<double>& radii,
+                                       size_t window_size,
+                                       size_t step_size,
+                                       const BallPivotingOption& option)
+    : radii_(radii),
+      window_size_(window_size),
+      step_size_(step_size),
+      option_(option) {
+    //step_size_ == window_size_では窓の間で何も引き継がれず，継ぎ目がつながらない
+    if (step_size_ == 0 || step_size_ >= window_size_) {
+        utility::LogError("step_size {:d} has to be in [1, window_size {:d})",
+                          step_size_, window_size_);
+    }
+    if (window_size_ >
+        static_cast<size_t>(std::numeric_limits<int>::max() / 2)) {
+        utility::LogError("window_size {:d} is too large", window_size_);
+    }
+    //メッシュ全体が必要なオプションは使えない．窓ごとのメッシュからは三角形だけを取り出す
+    option_.collapse_duplicates_ = false;
+    option_.compact_output_ = false;
+    option_.max_hole_edges_ = 0;
+    option_.output_boundaries_ = false;
+    option_.output_half_edges_ = false;
+    option_.organized_width_ = 0;
+    option_.spill_path_.clear();
+    option_.output_triangle_normals_ = false;
+    option_.output_vertex_normals_ = false;
+    option_.output_vertex_colors_ = false;
+}
+
+void BallPivotingStream::AddPoints(const PointCloud& pcd) {
+    if (!pcd.HasNormals()) {
+        utility::LogError("BallPivotingStream requires normals");
+    }
+    //三角形はストリームでのインデックスをintで持つ
+    if (static_cast<size_t>(begin_) + points_.size() + pcd.points_.size() >
+        static_cast<size_t>(std::numeric_limits<int>::max())) {
+        utility::LogError(
+                "BallPivotingStream supports at most {:d} points in total",
+                std::numeric_limits<int>::max());
+    }
+    points_.insert(points_.end(), pcd.points_.begin(), pcd.points_.end());
+    normals_.insert(normals_.end(), pcd.normals_.begin(), pcd.normals_.end());
+    while (begin_ + points_.size() >=
+           static_cast<size_t>(retired_) + window_size_) {
+        Reconstruct(false);
+    }
+}
+
+void BallPivotingStream::Finish() {
+    if (!points_.empty()) {
+        Reconstruct(true);
+    }
+}
+
+std::vector<Eigen::Vector3i> BallPivotingStream::TakeTriangles() {
+    std::vector<Eigen::Vector3i> triangles;
+    triangles.swap(finalized_);
+    return triangles;
+}
+
+//窓の点を再構成し，古いstep_size_点を引退させる．
+//三角形はストリームでのインデックスで持ち，BallPivotingには窓の中のインデックス(- begin_)で渡す
+void BallPivotingStream::Reconstruct(bool finish) {
+    utility::Timer timer;
+    timer.Start();
+    PointCloud window;
+    window.points_ = points_;
+    window.normals_ = normals_;
+
+    //属性は出力しないので，属性なしの特殊化を直接使う
+    BallPivoting<false, false, false> bp(window, option_);
+    std::vector<Eigen::Vector3i> fixed = carried_;
+    for (Eigen::Vector3i& triangle : fixed) {
+        triangle.array() -= begin_;
+    }
+    std::vector<int> frontier = frontier_;
+    for (int& vidx : frontier) {
+        vidx -= begin_;
+    }
+    bp.AddFixedTriangles(fixed, frontier, retired_ - begin_, radii_);
+    std::shared_ptr<TriangleMesh> mesh = bp.Run(radii_);
+
+    //引退した点だけを使う三角形を確定させる．それ以外は捨てて，次の窓で点が増えてから作り直す．
+    //引き継いだ三角形は登録した順にメッシュの先頭にあり，出力済み
+    const int retired = finish ? std::numeric_limits<int>::max()
+                               : retired_ + static_cast<int>(step_size_);
+    //これより前の点を使う三角形は，まだ引退していない点があっても確定させて点を捨てる
+    const int oldest = finish ? 0 : retired - static_cast<int>(window_size_);
+    std::vector<Eigen::Vector3i> closed;
+    std::unordered_set<int> frontier_set;
+    for (size_t tidx = 0; tidx < mesh->triangles_.size(); ++tidx) {
+        Eigen::Vector3i triangle = mesh->triangles_[tidx].array() + begin_;
+        if (triangle.maxCoeff() >= retired && triangle.minCoeff() >= oldest) {
+            for (int k = 0; k < 3; ++k) {
+                if (triangle(k) < retired) {
+                    frontier_set.insert(triangle(k));
+                }
+            }
+            continue;
+        }
+        if (tidx >= carried_.size()) {
+            finalized_.push_back(triangle);
+        }
+        closed.push_back(triangle);
+    }
+
+    //次の窓にはfrontierの頂点を使う確定済みの三角形を引き継ぐ(frontierの頂点の周りは全部そろう)
+    carried_.clear();
+    if (!finish) {
+        for (const Eigen::Vector3i& triangle : closed) {
+            if (triangle.minCoeff() >= oldest &&
+                (frontier_set.count(triangle(0)) > 0 ||
+                 frontier_set.count(triangle(1)) > 0 ||
+                 frontier_set.count(triangle(2)) > 0)) {
+                carried_.push_back(triangle);
+            }
+        }
+    }
+    frontier_.assign(frontier_set.begin(), frontier_set.end());
+    //三角形があるのにfrontierが空なら，先読み(window_size_ - step_size_)が近傍を覆っておらず，
+    //継ぎ目の三角形が作られていない可能性が高い
+    if (!finish && frontier_.empty() && !closed.empty() &&
+        !warned_empty_frontier_) {
+        utility::LogWarning(
+                "[BallPivotingStream] no triangle crosses the retired points; "
+                "window_size - step_size may not cover the ball neighborhood");
+        warned_empty_frontier_ = true;
+    }
+
+    //引き継いだ三角形とfrontierが使う一番古い点より前の点を捨てる
+    int begin = begin_ + static_cast<int>(points_.size());
+    if (!finish) {
+        begin = retired;
+        for (const Eigen::Vector3i& triangle : carried_) {
+            begin = std::min(begin, triangle.minCoeff());
+        }
+        for (int vidx : frontier_) {
+            begin = std::min(begin, vidx);
+        }
+    }
+    points_.erase(points_.begin(), points_.begin() + (begin - begin_));
+    normals_.erase(normals_.begin(), normals_.begin() + (begin - begin_));
+    begin_ = begin;
+    retired_ = finish ? begin : retired;
+    timer.Stop();
+    utility::LogDebug(
+            "[BallPivotingStream] finalized {:d} triangles, carried {:d}, "
+            "kept {:d} points in {:.2f} ms",
+            finalized_.size(), carried_.size(), points_.size(),
+            timer.GetDurationInMillisecond());
+}
+
 std::shared_ptr<TriangleMesh> TriangleMesh::CreateFromPointCloudBallPivoting(
         const PointCloud& pcd, const std::vector<double>& radii) {
-    BallPivoting bp(pcd);
-    return bp.Run(radii);
+    return ReconstructBallPivoting(pcd, radii);
 }
 
 }  // namespace geometry
@@ -0,0 +1,321 @@
+// ----------------------------------------------------------------------------
+// -                        Open3D: www.open3d.org                            -
+// ----------------------------------------------------------------------------
+// Copyright (c) 2018-2023 www.open3d.org
+// SPDX-License-Identifier: MIT
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <Eigen/Core>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+#include "open3d/geometry/HalfEdgeTriangleMesh.h"
+
+namespace open3d {
+namespace geometry {
+
+class PointCloud;
+
+/// \enum BallPivotingFrontOrder
+///
+/// \brief Order in which front edges are expanded.
+enum class BallPivotingFrontOrder {
+    /// Last created edge first, as in the original algorithm.
+    Lifo = 0,
+    /// Edge with the smallest Morton code of its midpoint first, so that
+    /// consecutive pivots touch nearby points, edges and triangles.
+    Morton = 1,
+    /// Shortest edge first. Short edges tend to close well-shaped triangles
+    /// before slivers can block the candidates of their neighbors.
+    ShortestEdge = 2,
+};
+
+/// \class BallPivotingOption
+///
+/// \brief Options for ReconstructBallPivoting.
+class BallPivotingOption {
+public:
+    BallPivotingOption() {}
+    ~BallPivotingOption() {}
+
+public:
+    /// Decide collinearity, coplanarity and segment intersection with
+    /// filtered predicates: the usual floating point evaluation is trusted
+    /// when it is outside its error bound, otherwise the sign is recomputed
+    /// exactly. Replaces the fixed 1e-16 / 1e-12 thresholds.
+    bool robust_predicates_ = false;
+    /// Collapse points closer than duplicate_epsilon_ to one point before
+    /// the reconstruction. Merging is transitive: a chain of points with
+    /// consecutive distances below duplicate_epsilon_ collapses into one
+    /// point even if its ends are farther apart. Non-finite points are never
+    /// merged. The triangles still index the input points and the output
+    /// keeps all input vertices.
+    bool collapse_duplicates_ = false;
+    /// Distance below which points are merged. 0 only merges exact
+    /// duplicates.
+    double duplicate_epsilon_ = 0.0;
+    /// A point whose number of neighbors within twice the ball radius is
+    /// below outlier_ratio_ times the reference count is ignored for seeding
+    /// and as pivot candidate. The reference count is the median over a
+    /// fixed sample of 256 evenly spaced points, taken once per radius. The
+    /// seed neighbor queries give the count of each tried point, so no
+    /// separate outlier removal pass is needed. 0 disables the check.
+    double outlier_ratio_ = 0.0;
+    /// Return a mesh that only contains the vertices referenced by a
+    /// triangle. BallPivotingResult::vertex_indices_ maps them back to the
+    /// input points.
+    bool compact_output_ = false;
+    /// Store a face normal per triangle in TriangleMesh::triangle_normals_.
+    bool output_triangle_normals_ = true;
+    /// Copy the point normals to TriangleMesh::vertex_normals_.
+    bool output_vertex_normals_ = true;
+    /// Copy the point colors to TriangleMesh::vertex_colors_.
+    bool output_vertex_colors_ = true;
+    /// After the last radius, fill the holes whose boundary loop has at most
+    /// this many edges with a minimum area triangulation. Values below 3
+    /// disable hole filling.
+    int max_hole_edges_ = 0;
+    /// Report the remaining boundary loops, open border edges and edges that
+    /// would have received a third triangle in BallPivotingResult.
+    bool output_boundaries_ = false;
+    /// Export the connectivity built during pivoting as half edges in
+    /// BallPivotingResult, so it does not have to be rebuilt downstream.
+    bool output_half_edges_ = false;
+    /// Width of an organized (row-major, H x W) point cloud. If set, no
+    /// KDTree is built: all neighbor queries read the pixel window of half
+    /// size organized_window_ around a nearby point, and seeds are tried in
+    /// pixel order. Missing pixels may hold NaN points. 0 treats the cloud
+    /// as unorganized. collapse_duplicates_ is ignored for organized clouds,
+    /// because merging points would break the pixel grid.
+    int organized_width_ = 0;
+    /// Half size in pixels of the neighbor window of an organized cloud. The
+    /// neighbor queries reach up to (1 + sqrt(2)) times the largest radius
+    /// from the pixel the window is centered on, and the window has to cover
+    /// that distance, otherwise points are missed and balls look empty. 0
+    /// derives the window from the largest radius and the median distance
+    /// between horizontally neighboring pixels. A warning is logged once if
+    /// a pixel on the border of a window is within a query radius.
+    int organized_window_ = 0;
+    /// Memory resource for all internal state of the reconstruction
+    /// (vertices, edges, triangles, fronts). It has to outlive the call. If
+    /// nullptr, a monotonic arena is used and released in one shot at the
+    /// end. The returned mesh is always allocated normally.
+    std::pmr::memory_resource* memory_resource_ = nullptr;
+    /// Sample the memory used by each structure at the phase boundaries of
+    /// the reconstruction into BallPivotingResult::memory_usage_. The samples
+    /// are also written to the debug log.
+    bool output_memory_usage_ = false;
+    /// Free the edges and triangles of regions where all vertices are Inner
+    /// as soon as they are closed, so peak memory follows the size of the
+    /// front instead of the mesh. The triangles stay in the output mesh. The
+    /// default internal memory resource becomes a pool that reuses the freed
+    /// blocks. Ignored if output_half_edges_ is set.
+    bool release_interior_ = false;
+    /// If not empty, finished triangles are written to this file in
+    /// compressed blocks of spill_block_triangles_ while pivoting, so only one
+    /// block is kept in memory. Vertex indices are delta coded and the face
+    /// normals are recomputed from the vertices when reading back.
+    std::string spill_path_;
+    /// Number of triangles per spilled block.
+    size_t spill_block_triangles_ = 1 << 16;
+    /// Read the spilled triangles back into the returned mesh at the end and
+    /// delete the file. If false, the mesh has no triangles and the file is
+    /// left for ReadBallPivotingSpill. Always read back when compact_output_,
+    /// output_half_edges_ or collapse_duplicates_ need the triangles.
+    bool spill_read_back_ = true;
+    /// Order of front expansion. The order changes which triangles win where
+    /// several are possible, so the output differs slightly from Lifo.
+    BallPivotingFrontOrder front_order_ = BallPivotingFrontOrder::Lifo;
+};
+
+/// \class BallPivotingMemoryUsage
+///
+/// \brief Bytes held by the reconstruction at one phase boundary.
+///
+/// resource_bytes_ and resource_peak_bytes_ are measured at the memory
+/// resource that holds all internal state, so they include what an arena
+/// keeps for freed nodes and regrown arrays. The per-structure sizes are
+/// estimated from element counts and capacities, the spatial index from the
+/// number of points, and are only a breakdown.
+class BallPivotingMemoryUsage {
+public:
+    BallPivotingMemoryUsage() {}
+    ~BallPivotingMemoryUsage() {}
+
+public:
+    /// Internal state as held by the memory resource, plus the spatial index
+    /// and the output mesh.
+    size_t Total() const {
+        return resource_bytes_ + index_bytes_ + mesh_bytes_;
+    }
+
+public:
+    /// Name of the phase, e.g. "start", "radius 0", "end".
+    std::string phase_;
+    /// Bytes the memory resource of the internal state holds from its
+    /// upstream (the default arena or pool) or has handed out (a
+    /// BallPivotingOption::memory_resource_).
+    size_t resource_bytes_ = 0;
+    /// Largest resource_bytes_ since the start, including between phases.
+    size_t resource_peak_bytes_ = 0;
+    /// Estimated vertex state including the per-vertex edge sets.
+    size_t vertex_bytes_ = 0;
+    /// Estimated edges that are alive.
+    size_t edge_bytes_ = 0;
+    /// Estimated triangles that are alive.
+    size_t triangle_bytes_ = 0;
+    /// Estimated front and border edge lists.
+    size_t queue_bytes_ = 0;
+    /// Spatial index and neighbor query buffers.
+    size_t index_bytes_ = 0;
+    /// Output mesh.
+    size_t mesh_bytes_ = 0;
+};
+
+/// \class BallPivotingResult
+///
+/// \brief Additional outputs of ReconstructBallPivoting.
+class BallPivotingResult {
+public:
+    BallPivotingResult() {}
+    ~BallPivotingResult() {}
+
+public:
+    /// Index of the input point for every vertex of the returned mesh, filled
+    /// if BallPivotingOption::compact_output_ is set.
+    std::vector<int> vertex_indices_;
+    /// Closed boundary loops of the regions that could not be meshed, as
+    /// ordered vertex indices. Filled if BallPivotingOption::output_boundaries_
+    /// is set.
+    std::vector<std::vector<int>> boundary_loops_;
+    /// Border edges (source, target) that do not form a simple closed loop,
+    /// e.g. around non-manifold vertices.
+    std::vector<Eigen::Vector2i> open_boundary_edges_;
+    /// Edges that already had two triangles when a third one was added.
+    std::vector<Eigen::Vector2i> non_manifold_edges_;
+    /// Half edges of the returned mesh if BallPivotingOption::
+    /// output_half_edges_ is set. Half edge 3 * t + k goes from vertex k to
+    /// vertex (k + 1) % 3 of triangle t, twin_ is -1 on the boundary.
+    std::vector<HalfEdgeTriangleMesh::HalfEdge> half_edges_;
+    /// Memory used at each phase boundary if BallPivotingOption::
+    /// output_memory_usage_ is set.
+    std::vector<BallPivotingMemoryUsage> memory_usage_;
+    /// Largest value of each field over memory_usage_, taken per field. Its
+    /// Total() is the sum of these per-field maxima, which no single sample
+    /// needs to reach. phase_ names the sample with the largest Total().
+    BallPivotingMemoryUsage peak_memory_usage_;
+};
+
+/// \brief Creates a TriangleMesh from an oriented PointCloud with the ball
+/// pivoting algorithm, see TriangleMesh::CreateFromPointCloudBallPivoting.
+///
+/// \param pcd PointCloud with normals.
+/// \param radii The radii of the ball that are used for the surface
+/// reconstruction.
+/// \param option Options of the reconstruction.
+/// \param result If not nullptr, receives the additional outputs requested
+/// in \p option.
+std::shared_ptr<TriangleMesh> ReconstructBallPivoting(
+        const PointCloud& pcd,
+        const std::vector<double>& radii,
+        const BallPivotingOption& option = BallPivotingOption(),
+        BallPivotingResult* result = nullptr);
+
+/// \brief Reads the triangles that ReconstructBallPivoting spilled to
+/// BallPivotingOption::spill_path_, one block at a time.
+///
+/// \param path The spill file.
+/// \param vertices Vertices of the returned mesh, used to recompute the face
+/// normals. Every vertex index in the file has to be below vertices.size().
+/// \param callback Called for every block with its triangles and face normals
+/// (empty if the file has no normals).
+/// \return false if the file could not be read, is truncated or corrupt, or
+/// references a vertex outside of vertices. Blocks before the failing one
+/// have already been passed to callback. A file cut exactly at a block
+/// boundary cannot be told apart from a shorter run and reads as valid.
+bool ReadBallPivotingSpill(
+        const std::string& path,
+        const std::vector<Eigen::Vector3d>& vertices,
+        const std::function<void(const std::vector<Eigen::Vector3i>&,
+                                 const std::vector<Eigen::Vector3d>&)>&
+                callback);
+
+/// \class BallPivotingStream
+///
+/// \brief Ball pivoting over an endless stream of points sorted by
+/// acquisition order (e.g. LiDAR scanlines) with bounded memory.
+///
+/// Points are reconstructed in a sliding window of window_size points. Each
+/// time window_size points past the retired ones are buffered, the window is
+/// reconstructed and its oldest step_size points are retired: triangles that
+/// only use retired points are finalized, the others are dropped and rebuilt
+/// in the next window with more points. The finalized triangles around them
+/// are carried over, so the front continues from their border edges. Retired
+/// points that no dropped triangle used are never touched again, so at most
+/// about 2 * window_size points are kept. Triangles index the points by their
+/// position in the stream, so a stream holds at most 2^31 - 1 points.
+///
+/// The lookahead window_size - step_size has to cover the 2 * max(radii)
+/// neighborhood in acquisition order: every point retired in a window has to
+/// have its neighbors within the following window_size - step_size points.
+/// Otherwise triangles across the seam are not found. Every window is
+/// reconstructed from scratch (KD-tree, vertices, pivoting over all its
+/// points), so a small step_size costs about window_size / step_size times
+/// the batch reconstruction.
+class BallPivotingStream {
+public:
+    /// \param radii The radii of the ball, see ReconstructBallPivoting.
+    /// \param window_size Number of points reconstructed together.
+    /// \param step_size Number of points retired per window, less than
+    /// window_size.
+    /// \param option Options of the reconstruction. Options that need the
+    /// whole mesh (hole filling, compaction, boundaries, half edges,
+    /// organized clouds, duplicate collapsing) are ignored.
+    BallPivotingStream(const std::vector<double>& radii,
+                       size_t window_size,
+                       size_t step_size,
+                       const BallPivotingOption& option = BallPivotingOption());
+    ~BallPivotingStream() {}
+
+public:
+    /// Appends points with normals (and optionally colors, which are
+    /// ignored) and reconstructs every full window.
+    void AddPoints(const PointCloud& pcd);
+    /// Reconstructs the buffered points and finalizes all triangles.
+    void Finish();
+    /// Returns the triangles finalized since the last call.
+    std::vector<Eigen::Vector3i> TakeTriangles();
+    /// Number of points currently kept in memory.
+    size_t GetNumBufferedPoints() const { return points_.size(); }
+
+private:
+    void Reconstruct(bool finish);
+
+private:
+    std::vector<double> radii_;
+    size_t window_size_;
+    size_t step_size_;
+    BallPivotingOption option_;
+    /// Stream index of points_[0].
+    int begin_ = 0;
+    /// Points before this stream index are retired.
+    int retired_ = 0;
+    std::vector<Eigen::Vector3d> points_;
+    std::vector<Eigen::Vector3d> normals_;
+    /// Finalized triangles around the frontier, carried into the next window
+    /// for their connectivity.
+    std::vector<Eigen::Vector3i> carried_;
+    /// Retired points used by triangles that are not finalized yet.
+    std::vector<int> frontier_;
+    std::vector<Eigen::Vector3i> finalized_;
+    /// Warned that a window left no frontier.
+    bool warned_empty_frontier_ = false;
+};
+
+}  // namespace geometry
+}  // namespace open3d